@@ -51,20 +51,31 @@ void Args::printHelp() {
 -uid <unique_id>   : specifies to use the GPU with the given unique_id (only on ROCm/Linux)
 -user <name>       : specify the user name.
 -cpu  <name>       : specify the hardware name.
--time              : display kernel profiling information.
+-time [<K>]        : display kernel profiling information. With <K>, only one squaring in <K> is timed,
+                     which has negligible overhead and can be left on.
+-trace <N>         : write a timeline of the last <N> kernel launches and host steps to trace.json,
+                     for chrome://tracing or ui.perfetto.dev
 -fft <spec>        : specify FFT e.g.: 1152K, 5M, 5.5M, 256:10:1K
 -block <value>     : PRP error-check block size. Must divide 10'000.
 -log <step>        : log every <step> iterations. Multiple of 10'000.
 -carry long|short  : force carry type. Short carry may be faster, but requires high bits/word.
+-pack gpu|host|check : where the residues are packed into bits when read from the GPU, and expanded when
+                     written to it. 'host' is the reference, 'check' does both and compares them. Default 'gpu'.
 -B1                : P-1 B1 bound
 -B2                : P-1 B2 bound
 -rB2               : ratio of B2 to B1. Default %u, used only if B2 is not explicitly set
 -prp <exponent>    : run a single PRP test and exit, ignoring worktodo.txt
 -verify <file>     : verify PRP-proof contained in <file>
+-bench [<min>:<max>] : benchmark every FFT, or only the FFT sizes in the range (e.g. 4M:8M), and write bench.csv
+                     with the host submit time per iteration, also without skipping the unchanged kernel arguments
+-tune <exponent>   : time the FFTs and kernel variants for <exponent>, and save the fastest in tune.txt
+                     which is then used for all the exponents that have the same candidate FFTs
 -proof <power>     : By default a proof of power 8 is generated, using 3GB of temporary disk space for a 100M exponent.
                      A lower power reduces disk space requirements but increases the verification cost.
                      A proof of power 9 uses 6GB of disk space for a 100M exponent and enables faster verification.
 -autoverify <power> : Self-verify proofs generated with at least this power. Default 9.
+-proofMem <MB>     : memory for proof checkpoints waiting to be written to disk, and read ahead when
+                     generating the proof. Default 128.
 -tmpDir <dir>      : specify a folder with plenty of disk space where temporary proof checkpoints will be stored.
 -results <file>    : name of results file, default 'results.txt'
 -iters <N>         : run next PRP test for <N> iterations and exit. Multiple of 10000.
@@ -78,6 +89,9 @@ void Args::printHelp() {
 -use NEW_FFT8,OLD_FFT5,NEW_FFT10: comma separated list of defines, see the #if tests in gpuowl.cl (used for perf tuning)
 -unsafeMath        : use OpenCL -cl-unsafe-math-optimizations (use at your own risk)
 -binary <file>     : specify a file containing the compiled kernels binary
+-cache <dir>       : directory where compiled kernels are cached for reuse across runs, default 'kernel-cache'
+-tables <dir>      : directory where the precomputed weights, trig tables and P2 plans are cached, default 'table-cache'
+-nocache           : do not cache the compiled kernels nor the precomputed tables
 -device <N>        : select a specific device:
 )", B2_B1_ratio);
 
@@ -145,6 +159,8 @@ void Args::parse(const string& line) {
         throw "-autoverify <power>";
       }
       proofVerify = stoi(s);
+    } else if (key == "-proofMem") {
+      proofMem = stoi(s);
     } else if (key == "-tmpDir" || key == "-tmpdir") {
       if (s.empty()) {
         log("-tmpDir needs <dir>\n");
@@ -180,6 +196,11 @@ void Args::parse(const string& line) {
     else if (key == "-log") { logStep = stoi(s); assert(logStep && (logStep % 10000 == 0)); }
     else if (key == "-iters") { iters = stoi(s); assert(iters && (iters % 10000 == 0)); }
     else if (key == "-prp" || key == "-PRP") { prpExp = stoll(s); }
+    else if (key == "-tune") { tuneExp = stoll(s); }
+    else if (key == "-bench") {
+      bench = true;
+      benchRange = s;
+    }
     else if (key == "-B1" || key == "-b1") { B1 = stoi(s); }
     else if (key == "-B2" || key == "-b2") { B2 = stoi(s); }
     else if (key == "-rB2") { B2_B1_ratio = stoi(s); }
@@ -187,7 +208,19 @@ void Args::parse(const string& line) {
     else if (key == "-dump") { dump = s; }
     else if (key == "-user") { user = s; }
     else if (key == "-cpu") { cpu = s; }
-    else if (key == "-time") { timeKernels = true; }
+    else if (key == "-time") {
+      if (s.empty()) {
+        timeKernels = true;
+      } else {
+        int period = stoi(s);
+        if (period < 1) {
+          log("-time expects a sampling period of at least 1, e.g. -time 1000\n");
+          throw "-time <K>";
+        }
+        timeSample = period;
+      }
+    }
+    else if (key == "-trace") { traceSize = stoi(s); }
     else if (key == "-device" || key == "-d") { device = stoi(s); }
     else if (key == "-uid") { device = getSeqId(s); }
     else if (key == "-dir") { dir = s; }
@@ -200,6 +233,13 @@ void Args::parse(const string& line) {
         log("-carry expects short|long\n");
         throw "-carry expects short|long";
       }
+    } else if (key == "-pack") {
+      if (s == "gpu" || s == "host" || s == "check") {
+        pack = s == "gpu" ? PACK_GPU : s == "host" ? PACK_HOST : PACK_CHECK;
+      } else {
+        log("-pack expects gpu|host|check\n");
+        throw "-pack expects gpu|host|check";
+      }
     } else if (key == "-block") {
       blockSize = stoi(s);
       if (10000 % blockSize) {
@@ -215,6 +255,21 @@ void Args::parse(const string& line) {
       safeMath = false;
     } else if (key == "-binary") {
       binaryFile = s;
+    } else if (key == "-cache") {
+      if (s.empty()) {
+        log("-cache needs <dir>\n");
+        throw "-cache needs <dir>";
+      }
+      kernelCacheDir = s;
+    } else if (key == "-tables") {
+      if (s.empty()) {
+        log("-tables needs <dir>\n");
+        throw "-tables needs <dir>";
+      }
+      tableCacheDir = s;
+    } else if (key == "-nocache") {
+      kernelCacheDir.clear();
+      tableCacheDir.clear();
     } else if (key == "-save") {
       nSavefiles = stoi(s);      
     } else if (key == "-from") {
@@ -246,6 +301,8 @@ void Args::setDefaults() {
     if (proofResultDir.is_relative()) { proofResultDir = masterDir / proofResultDir; }
     if (proofToVerifyDir.is_relative()) { proofToVerifyDir = masterDir / proofToVerifyDir; }
     if (resultsFile.is_relative()) { resultsFile = masterDir / resultsFile; }
+    if (!kernelCacheDir.empty() && kernelCacheDir.is_relative()) { kernelCacheDir = masterDir / kernelCacheDir; }
+    if (!tableCacheDir.empty() && tableCacheDir.is_relative()) { tableCacheDir = masterDir / tableCacheDir; }
   }
 
   fs::create_directory(proofResultDir);
@@ -15,6 +15,7 @@ public:
   static std::string mergeArgs(int argc, char **argv);
 
   enum {CARRY_AUTO = 0, CARRY_SHORT, CARRY_LONG};
+  enum {PACK_GPU = 0, PACK_HOST, PACK_CHECK};
 
   void parse(const string& line);
   void setDefaults();
@@ -33,6 +34,8 @@ public:
   int device = 0;
   
   bool timeKernels = false;
+  u32 timeSample = 0; // profile only one squaring in timeSample
+  u32 traceSize = 0;  // the number of events kept for trace.json, 0 for no tracing
   bool cudaYield = false;
   bool noSpin = false;
   bool safeMath = true;
@@ -40,17 +43,23 @@ public:
   
   u32 proofPow = 8;
   u32 proofVerify = 9;
+  u32 proofMem = 128; // MB of proof residues buffered in memory, see ProofCache and ProofSet::computeProof()
 
   fs::path resultsFile = "results.txt";
   fs::path masterDir;
   fs::path tmpDir = ".";
   fs::path proofResultDir = "proof";
   fs::path proofToVerifyDir = "proof-tmp";
+  fs::path kernelCacheDir = "kernel-cache";  // empty disables the compiled kernels cache
+  u32 kernelCacheSize = 24;
+  fs::path tableCacheDir = "table-cache";    // empty disables the precomputed tables cache
+  u32 tableCacheSize = 16;
   // fs::path proofBadDir = "bad-proof";
   
   bool keepProof = false;
 
   int carry = CARRY_AUTO;
+  int pack = PACK_GPU;
   u32 blockSize = 0;
   u32 logStep   = 0;
   string fftSpec;
@@ -61,6 +70,10 @@ public:
   u32 D = 0;
   
   u32 prpExp = 0;
+
+  bool bench = false;
+  string benchRange;   // e.g. "4M:8M"; empty means all the FFTs
+  u32 tuneExp = 0;
   
   size_t maxAlloc = 0;
 
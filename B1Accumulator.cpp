@@ -7,6 +7,7 @@
 #include "GmpUtil.h"
 #include "Args.h"
 #include "Saver.h"
+#include "Trace.h"
 
 #include <tuple>
 
@@ -175,6 +176,7 @@ void B1Accumulator::load(u32 k) {
 
 template<typename T>
 void B1Accumulator::step(u32 kAt, Buffer<T>& data) {
+  TraceSpan span{"B1Accumulator::step"};
   assert(nextK && kAt == nextK);
   assert(nextK < bits.size() && bits[nextK]);
   
@@ -0,0 +1,254 @@
+// Copyright Mihai Preda.
+
+#include "Bench.h"
+#include "Args.h"
+#include "Gpu.h"
+#include "FFTConfig.h"
+#include "File.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+constexpr u32 BENCH_ITERS = 2000;
+
+// The tuning database, next to config.txt. Each line is: <minExp> <maxExp> <FFT spec> [<comma separated -use flags>]
+const fs::path TUNE_FILE = "tune.txt";
+
+// A variant that hits a larger roundoff than this is not considered safe.
+constexpr double MAX_SAFE_ROUNDOFF = 0.4;
+
+// A variant must be faster by this factor to be preferred over the default, so that noise is not picked up as a win.
+constexpr double MIN_GAIN = 0.99;
+
+// Groups of mutually exclusive kernel variants. Not using any flag from a group means the group's default.
+// The accuracy defines (MM_CHAIN, MM2_CHAIN, MAX_ACCURACY, ULTRA_TRIG) and the carry width (CARRY32, CARRY64)
+// are not tuned: they are derived from the exponent in makeDefines(), and a choice made at one exponent
+// is not safe (or does not even compile) for all the exponents of the tuned range.
+const vector<vector<string>> VARIANTS = {
+  {"NEW_FFT8", "NEWEST_FFT8"},
+  {"OLD_FFT5", "NEWEST_FFT5"},
+  {"TRIG_COMPUTE=0", "TRIG_COMPUTE=1"},
+};
+
+pair<u32, u32> parseRange(const string& range) {
+  if (range.empty()) { return {0, u32(-1)}; }
+  auto pos = range.find(':');
+  if (pos == string::npos) {
+    log("-bench range must be of the form <min>:<max>, e.g. 4M:8M; found '%s'\n", range.c_str());
+    throw "-bench range";
+  }
+  return {FFTConfig::fromSpec(range.substr(0, pos)).fftSize(), FFTConfig::fromSpec(range.substr(pos + 1)).fftSize()};
+}
+
+}
+
+void bench(const Args& args) {
+  auto [minSize, maxSize] = parseRange(args.benchRange);
+  
+  Args benchArgs = args;
+  benchArgs.timeKernels = true;
+  benchArgs.flags.insert("STATS");
+
+  File table = File::openWrite("bench.csv");
+  table.printf("fft,spec,exponent,us_per_it,submit_us_per_it,submit_us_per_it_all_args,max_roundoff\n");
+  File kernels = File::openWrite("bench-kernels.csv");
+  kernels.printf("spec,kernel,us_per_call,calls,percent\n");
+  
+  for (FFTConfig config : FFTConfig::genConfigs()) {
+    u32 N = config.fftSize();
+    if (N < minSize || N > maxSize) { continue; }
+
+    // The largest exponent for this FFT, so that the roundoff is the worst case.
+    u32 E = config.maxExp();
+    string spec = config.spec();
+    benchArgs.fftSpec = spec;
+
+    BenchResult r;
+    try {
+      r = Gpu::make(E, benchArgs)->benchmark(BENCH_ITERS);
+    } catch (const char *mes) {
+      log("bench %s failed: %s\n", spec.c_str(), mes);
+      continue;
+    } catch (const std::exception& e) {
+      // e.g. gpu_error or bad_alloc from a config above -maxAlloc: skip it like a compile failure.
+      log("bench %s failed: %s\n", spec.c_str(), e.what());
+      continue;
+    }
+    
+    log("bench %s %s E=%u : %.1f us/it (submit %.2f us/it, %.2f setting all args), max roundoff %.3f\n",
+        numberK(N).c_str(), spec.c_str(), E, r.usPerIt, r.submitUsPerIt, r.submitUsPerItAllArgs, r.maxRoundoff);
+    table.printf("%u,%s,%u,%.2f,%.2f,%.2f,%.4f\n",
+                 N, spec.c_str(), E, r.usPerIt, r.submitUsPerIt, r.submitUsPerItAllArgs, r.maxRoundoff);
+    table.flush();
+    
+    double total = 0;
+    for (auto& [stats, name] : r.profile) { total += stats.total; }
+    for (auto& [stats, name] : r.profile) {
+      kernels.printf("%s,%s,%.2f,%u,%.2f\n", spec.c_str(), name.c_str(), stats.total * 1e6 / stats.n, stats.n, 100 * stats.total / total);
+    }
+    kernels.flush();
+  }
+}
+
+namespace {
+
+string flagLabel(const string& flag) { return flag.substr(0, flag.find('=')); }
+
+// The exponents (lo, hi] that have the same set of candidate FFTs as E.
+pair<u32, u32> tuneRange(u32 E) {
+  u32 lo = 0, hi = u32(-1);
+  for (FFTConfig c : FFTConfig::genConfigs()) {
+    u32 maxExp = c.maxExp();
+    if (maxExp < E) {
+      lo = std::max(lo, maxExp);
+    } else {
+      hi = std::min(hi, maxExp);
+    }
+  }
+  return {lo, hi};
+}
+
+// The FFTs that can handle E, from the two smallest such FFT sizes.
+vector<FFTConfig> candidates(u32 E) {
+  vector<FFTConfig> ret;
+  vector<u32> sizes;
+  for (FFTConfig c : FFTConfig::genConfigs()) {
+    if (c.maxExp() < E) { continue; }
+    if (std::find(sizes.begin(), sizes.end(), c.fftSize()) == sizes.end()) {
+      if (sizes.size() == 2) { continue; }
+      sizes.push_back(c.fftSize());
+    }
+    ret.push_back(c);
+  }
+  return ret;
+}
+
+string join(const set<string>& flags) {
+  string s;
+  for (const string& f : flags) { s += (s.empty() ? "" : ",") + f; }
+  return s;
+}
+
+// Returns us/it, or nullopt if it fails or the roundoff is not safe.
+optional<double> timeVariant(const Args& args, u32 E, FFTConfig config, const set<string>& variant) {
+  Args tuneArgs = args;
+  tuneArgs.fftSpec = config.spec();
+  tuneArgs.timeKernels = false;
+  tuneArgs.flags.insert(variant.begin(), variant.end());
+  tuneArgs.flags.insert("STATS");
+
+  BenchResult r;
+  try {
+    r = Gpu::make(E, tuneArgs)->benchmark(BENCH_ITERS);
+  } catch (const char *mes) {
+    log("tune %s [%s] failed: %s\n", config.spec().c_str(), join(variant).c_str(), mes);
+    return {};
+  } catch (const std::exception& e) {
+    // e.g. gpu_error or bad_alloc: skip the variant, as bench() skips the config.
+    log("tune %s [%s] failed: %s\n", config.spec().c_str(), join(variant).c_str(), e.what());
+    return {};
+  }
+
+  // A zero roundoff means too few samples were collected to measure it.
+  bool safe = r.maxRoundoff > 0 && r.maxRoundoff <= MAX_SAFE_ROUNDOFF;
+  log("tune %s [%s] : %.1f us/it, max roundoff %.3f%s\n",
+      config.spec().c_str(), join(variant).c_str(), r.usPerIt, r.maxRoundoff, safe ? "" : " (not safe)");
+  if (!safe) { return {}; }
+  return r.usPerIt;
+}
+
+void saveTuned(u32 lo, u32 hi, const TunedFFT& tuned) {
+  vector<string> lines;
+  if (File fi = File::openRead(TUNE_FILE)) {
+    for (const string& line : fi) {
+      u32 a = 0, b = 0;
+      if (sscanf(line.c_str(), "%u %u", &a, &b) == 2 && a == lo && b == hi) { continue; }
+      lines.push_back(line);
+    }
+  }
+  
+  char buf[256];
+  snprintf(buf, sizeof(buf), "%u %u %s %s\n", lo, hi, tuned.config.spec().c_str(), join(tuned.flags).c_str());
+  lines.push_back(buf);
+
+  fs::path tmp = TUNE_FILE;
+  tmp += ".tmp";
+  {
+    File fo = File::openWrite(tmp);
+    for (const string& line : lines) { fo.write(line); }
+  }
+  fs::rename(tmp, TUNE_FILE);
+}
+
+}
+
+void tune(const Args& args, u32 E) {
+  auto [lo, hi] = tuneRange(E);
+  if (hi == u32(-1)) {
+    log("tune: no FFT for %u\n", E);
+    throw "tune";
+  }
+  log("tuning %u, for exponents in (%u, %u]\n", E, lo, hi);
+
+  // The result is used for the whole range, so it is measured at the range's worst roundoff: its top exponent,
+  // which every candidate FFT can handle.
+  optional<FFTConfig> best;
+  double bestTime = INFINITY;
+  for (FFTConfig config : candidates(E)) {
+    if (optional<double> t = timeVariant(args, hi, config, {}); t && *t < bestTime) {
+      best = config;
+      bestTime = *t;
+    }
+  }
+  
+  if (!best) {
+    log("tune: no safe FFT for %u\n", E);
+    throw "tune";
+  }
+
+  set<string> bestFlags;
+  for (const vector<string>& group : VARIANTS) {
+    bool userSet = std::any_of(args.flags.begin(), args.flags.end(), [&group](const string& f) {
+        return std::any_of(group.begin(), group.end(), [&f](const string& g) { return flagLabel(g) == flagLabel(f); });
+      });
+    if (userSet) { continue; }
+
+    string chosen;
+    for (const string& flag : group) {
+      set<string> variant = bestFlags;
+      variant.insert(flag);
+      if (optional<double> t = timeVariant(args, hi, *best, variant); t && *t < bestTime * MIN_GAIN) {
+        chosen = flag;
+        bestTime = *t;
+      }
+    }
+    if (!chosen.empty()) { bestFlags.insert(chosen); }
+  }
+
+  log("tune %u : best %s [%s] %.1f us/it\n", E, best->spec().c_str(), join(bestFlags).c_str(), bestTime);
+  saveTuned(lo, hi, {*best, bestFlags});
+}
+
+optional<TunedFFT> findTuned(u32 E) {
+  File fi = File::openRead(TUNE_FILE);
+  if (!fi) { return {}; }
+  
+  for (const string& line : fi) {
+    u32 lo = 0, hi = 0;
+    char spec[64] = {0}, flags[512] = {0};
+    int n = sscanf(line.c_str(), "%u %u %63s %511s", &lo, &hi, spec, flags);
+    if (n < 3 || !(lo < E && E <= hi)) { continue; }
+
+    TunedFFT tuned{FFTConfig::fromSpec(spec), {}};
+    std::istringstream iss{flags};
+    for (string flag; std::getline(iss, flag, ',');) {
+      if (!flag.empty()) { tuned.flags.insert(flag); }
+    }
+    return tuned;
+  }
+  return {};
+}
@@ -0,0 +1,27 @@
+// Copyright Mihai Preda.
+
+#pragma once
+
+#include "FFTConfig.h"
+#include "common.h"
+
+#include <optional>
+#include <set>
+#include <string>
+
+class Args;
+
+// Times every FFT config (or those in args.benchRange) and writes the results to bench.csv and bench-kernels.csv.
+void bench(const Args& args);
+
+// Times the FFTs that can handle E, and the kernel variants (-use flags) on the fastest one. The fastest
+// with a safe roundoff is saved in the tuning database, for the range of exponents that have the same candidate FFTs.
+void tune(const Args& args, u32 E);
+
+struct TunedFFT {
+  FFTConfig config;
+  std::set<std::string> flags;
+};
+
+// Looks up E in the tuning database written by tune().
+std::optional<TunedFFT> findTuned(u32 E);
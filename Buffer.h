@@ -122,6 +122,12 @@ public:
     ::write(this->queue->get(), true, this->get(), vect.size() * sizeof(T), vect.data());
   }
 
+  // async write: "vect" must not change until the queue is finished.
+  void writeAsync(const vector<T>& vect) {
+    assert(this->size >= vect.size());
+    ::write(this->queue->get(), false, this->get(), vect.size() * sizeof(T), vect.data());
+  }
+
   operator vector<T>() const { return read(); }
 
   // async read
@@ -1,4 +1,5 @@
 #include "Pm1Plan.h"
+#include "Sieve.h"
 #include "timeutil.h"
 
 #include <vector>
@@ -8,28 +9,39 @@
 #include <numeric>
 #include <bitset>
 
+// The reference single-threaded Eratosthenes sieve, for benchmarking sieve::bits().
+static vector<bool> simpleSieve(u32 B1, u32 B2) {
+  vector<bool> bits(B2 + 1);
+  bits[0] = bits[1] = true;
+  for (u32 p = 0; p <= B2; ++p) {
+    while (p <= B2 && bits[p]) { ++p; }
+    if (p > B2) { break; }
+    if (p <= B1) { bits[p] = true; }
+    if (p < (1u << 16) && p * p <= B2) { for (u32 i = p * p; i <= B2; i += p) { bits[i] = true; }}
+  }
+  bits.flip();
+  return bits;
+}
+
 int main(int argc, char** argv) {
   initLog();
   
   if (argc < 4) {
-    printf("Use: D <B1> <B2> <nBuf>\nE.g. D 5000000 150000000 300\n");
+    printf("Use: D <B1> <B2> <nBuf> [<us/MUL>]\nE.g. D 5000000 150000000 300 1200\n");
     exit(-1);
   }
   
   u32 B1 = atoi(argv[1]);
   u32 B2 = atoi(argv[2]);
   u32 nBuf = atoi(argv[3]);
+  float usPerMul = argc > 4 ? atof(argv[4]) : 0;
 
   Timer timer;
-  vector<bool> primeBits{Pm1Plan::sieve(B1, B2)};
-  // log("primes %.1fs\n", timer.deltaSecs());
+  vector<bool> primeBits{sieve::bits(B1 + 1, B2)};
+  double secsSieve = timer.deltaSecs();
+  bool same = primeBits == simpleSieve(B1, B2);
+  log("sieve %.2fs, simple sieve %.2fs%s\n", secsSieve, timer.deltaSecs(), same ? "" : " MISMATCH");
   
-  // for (u32 nBuf = 284; nBuf < 450; nBuf += nBuf < 100 ? 10 : 30) {
   printf("\nnBuf = %u\n", nBuf);
-  for (u32 D : {210, 330, 420, 462, 660, 770, 924, 1540, 2310}) {    
-    if (nBuf >= Pm1Plan::minBufsFor(D)) {
-      Pm1Plan plan{D, nBuf, B1, B2, vector{primeBits}};
-      plan.makePlan();
-    }
-  }  
+  Pm1Plan::chooseD(nBuf, B1, B2, usPerMul * 1e-6f);
 }
@@ -1,6 +1,6 @@
 // Copyright (C) Mihai Preda.
 
-#include "Pm1Plan.h"
+#include "Sieve.h"
 #include "GmpUtil.h"
 
 #include <gmp.h>
@@ -52,15 +52,12 @@ vector<u32> factorize(const string& str, u32 exponent, u32 B1, u32 B2) {
   assert(mpz_divisible_ui_p(n.get_mpz_t(), exponent));
   n /= exponent;
   
-  vector<bool> isPrime = Pm1Plan::sieve(B1);
-  for (u32 p = 2; p <= B1; ++p) {
-    if (isPrime[p]) {
-      while(mpz_divisible_ui_p(n.get_mpz_t(), p)) {
-        factors.push_back(p);
-        n /= p;
-      }
-      if (n == 1) { return factors; }
+  for (u32 p : sieve::primes(2, B1)) {
+    while(mpz_divisible_ui_p(n.get_mpz_t(), p)) {
+      factors.push_back(p);
+      n /= p;
     }
+    if (n == 1) { return factors; }
   }
   if (n <= B2) {
     factors.push_back(n.get_ui());
@@ -14,6 +14,11 @@
 #include "Task.h"
 #include "Memlock.h"
 #include "B1Accumulator.h"
+#include "KernelCache.h"
+#include "Bench.h"
+#include "TableCache.h"
+#include "Trace.h"
+#include "parallel.h"
 
 #define _USE_MATH_DEFINES
 #include <cmath>
@@ -23,6 +28,7 @@
 #include <optional>
 #include <numeric>
 #include <bitset>
+#include <mutex>
 #include <limits>
 #include <iomanip>
 #include <quadmath.h>
@@ -51,6 +57,11 @@ struct Weights {
   
   vector<u32> bitsCF;
   vector<u32> bitsC;
+
+  double weightStep;
+  double iweightStep;
+  vector<double> fWeights;
+  vector<double> iWeights;
 };
 
 namespace {
@@ -111,9 +122,37 @@ ConstBuffer<double2> genMiddleTrig(const Context& context, u32 smallH, u32 middl
 template<typename T>
 vector<pair<T, T>> makeTrig(u32 n) {
   assert(n % 8 == 0);
-  vector<pair<T, T>> tab;
-  tab.reserve(n/8 + 1);
-  for (u32 k = 0; k <= n/8; ++k) { tab.push_back(root1<T>(n, k)); }
+  vector<pair<T, T>> tab(n/8 + 1);
+  parallelFor(n/8 + 1, [&tab, n](u32 begin, u32 end) { for (u32 k = begin; k < end; ++k) { tab[k] = root1<T>(n, k); } });
+  return tab;
+}
+
+// The same values as makeTrig<double>(n), but without recomputing them.
+vector<double2> toDouble(const vector<pair<f128, f128>>& tab) {
+  vector<double2> ret;
+  ret.reserve(tab.size());
+  for (auto [c, s] : tab) { ret.push_back({c, s}); }
+  return ret;
+}
+
+// A trig table entry as stored in the table cache, which needs a trivially copyable type (pair<> is not).
+struct CachedRoot { f128 cos, sin; };
+
+// makeTrig<f128>(n), from the table cache when possible.
+vector<pair<f128, f128>> cachedTrig(const Args& args, u32 n) {
+  if (args.tableCacheDir.empty()) { return makeTrig<f128>(n); }
+
+  TableCache cache{args.tableCacheDir, args.tableCacheSize};
+  string name = "trig-" + to_string(n);
+  if (auto parts = cache.load(name, 1)) {
+    vector<pair<f128, f128>> tab;
+    for (auto [c, s] : TableCache::fromBytes<CachedRoot>((*parts)[0])) { tab.push_back({c, s}); }
+    return tab;
+  }
+  auto tab = makeTrig<f128>(n);
+  vector<CachedRoot> roots;
+  for (auto [c, s] : tab) { roots.push_back({c, s}); }
+  cache.save(name, {TableCache::toBytes(roots)});
   return tab;
 }
 
@@ -175,43 +214,88 @@ Weights genWeights(u32 E, u32 W, u32 H, u32 nW) {
     carryWeightsIFSP.push_back(to3SP(2 * w));
   }
   
-  vector<u32> bits;
-  
-  for (u32 line = 0; line < H; ++line) {
-    for (u32 thread = 0; thread < groupWidth; ) {
-      std::bitset<32> b;
-      for (u32 bitoffset = 0; bitoffset < 32; bitoffset += nW*2, ++thread) {
-        for (u32 block = 0; block < nW; ++block) {
-          for (u32 rep = 0; rep < 2; ++rep) {
-            if (isBigWord(N, E, kAt(H, line, block * groupWidth + thread) + rep)) { b.set(bitoffset + block * 2 + rep); }
-          }        
-	}
-      }
-      bits.push_back(b.to_ulong());
-    }
+  vector<double> fWeights;
+  vector<double> iWeights;
+  for (u32 i = 0; i < CARRY_LEN; ++i) {
+    fWeights.push_back(weight(N, E, H, 0, 0, 2*i) - 1);
+    iWeights.push_back(invWeight(N, E, H, 0, 0, 2*i) - 1);
   }
-  assert(bits.size() == N / 32);
-  
-  vector<u32> bitsC;
-  
-  for (u32 gy = 0; gy < H / CARRY_LEN; ++gy) {
-    for (u32 gx = 0; gx < nW; ++gx) {
+
+  return Weights{threadWeightsIF, threadWeightsIFSP, carryWeightsIF, carryWeightsIFSP, {}, {},
+                 double(weight(N, E, H, 0, 0, 1) - 1), double(invWeight(N, E, H, 0, 0, 1) - 1), fWeights, iWeights};
+}
+
+// The big-word bits, which are the bulk of the weights data: N/16 words.
+pair<vector<u32>, vector<u32>> genBits(u32 E, u32 W, u32 H, u32 nW) {
+  u32 N = 2u * W * H;
+  u32 groupWidth = W / nW;
+
+  vector<u32> bits(N / 32);
+  u32 wordsPerLine = W / 16;
+
+  parallelFor(H, [&](u32 lineBegin, u32 lineEnd) {
+    for (u32 line = lineBegin; line < lineEnd; ++line) {
+      u32* out = bits.data() + line * wordsPerLine;
       for (u32 thread = 0; thread < groupWidth; ) {
         std::bitset<32> b;
-        for (u32 bitoffset = 0; bitoffset < 32; bitoffset += CARRY_LEN * 2, ++thread) {
-          for (u32 block = 0; block < CARRY_LEN; ++block) {
+        for (u32 bitoffset = 0; bitoffset < 32; bitoffset += nW*2, ++thread) {
+          for (u32 block = 0; block < nW; ++block) {
             for (u32 rep = 0; rep < 2; ++rep) {
-              if (isBigWord(N, E, kAt(H, gy * CARRY_LEN + block, gx * groupWidth + thread) + rep)) { b.set(bitoffset + block * 2 + rep); }
+              if (isBigWord(N, E, kAt(H, line, block * groupWidth + thread) + rep)) { b.set(bitoffset + block * 2 + rep); }
             }
           }
         }
-        bitsC.push_back(b.to_ulong());
+        *out++ = b.to_ulong();
       }
+      assert(out == bits.data() + (line + 1) * wordsPerLine);
     }
-  }
-  assert(bitsC.size() == N / 32);
+  }, 16);
+  
+  vector<u32> bitsC(N / 32);
+  u32 wordsPerGroup = W / 2;
+
+  parallelFor(H / CARRY_LEN, [&](u32 gyBegin, u32 gyEnd) {
+    for (u32 gy = gyBegin; gy < gyEnd; ++gy) {
+      u32* out = bitsC.data() + gy * wordsPerGroup;
+      for (u32 gx = 0; gx < nW; ++gx) {
+        for (u32 thread = 0; thread < groupWidth; ) {
+          std::bitset<32> b;
+          for (u32 bitoffset = 0; bitoffset < 32; bitoffset += CARRY_LEN * 2, ++thread) {
+            for (u32 block = 0; block < CARRY_LEN; ++block) {
+              for (u32 rep = 0; rep < 2; ++rep) {
+                if (isBigWord(N, E, kAt(H, gy * CARRY_LEN + block, gx * groupWidth + thread) + rep)) { b.set(bitoffset + block * 2 + rep); }
+              }
+            }
+          }
+          *out++ = b.to_ulong();
+        }
+      }
+      assert(out == bitsC.data() + (gy + 1) * wordsPerGroup);
+    }
+  }, 2);
+  
+  return {bits, bitsC};
+}
 
-  return Weights{threadWeightsIF, threadWeightsIFSP, carryWeightsIF, carryWeightsIFSP, bits, bitsC};
+// The weights, with the bits from the table cache when possible. The other weights are cheap to compute.
+Weights makeWeights(const Args& args, u32 E, u32 W, u32 H, u32 nW) {
+  Weights weights = genWeights(E, W, H, nW);
+  
+  if (args.tableCacheDir.empty()) {
+    std::tie(weights.bitsCF, weights.bitsC) = genBits(E, W, H, nW);
+    return weights;
+  }
+  
+  TableCache cache{args.tableCacheDir, args.tableCacheSize};
+  string name = "bits-" + to_string(E) + '-' + numberK(W) + '-' + numberK(H) + '-' + to_string(nW);
+  if (auto parts = cache.load(name, 2)) {
+    weights.bitsCF = TableCache::fromBytes<u32>((*parts)[0]);
+    weights.bitsC  = TableCache::fromBytes<u32>((*parts)[1]);
+  } else {
+    std::tie(weights.bitsCF, weights.bitsC) = genBits(E, W, H, nW);
+    cache.save(name, {TableCache::toBytes(weights.bitsCF), TableCache::toBytes(weights.bitsC)});
+  }
+  return weights;
 }
 
 string toLiteral(u32 value) { return to_string(value) + 'u'; }
@@ -277,13 +361,11 @@ float3 to3SP(f128 x) {
   return ret;
 }
 
-cl_program compile(const Args& args, cl_context context, cl_device_id id, u32 N, u32 E, u32 WIDTH, u32 SMALL_HEIGHT, u32 MIDDLE, u32 nW) {
-  string clArgs = args.dump.empty() ? ""s : (" -save-temps="s + args.dump + "/" + numberK(N));
-  if (!args.safeMath) { clArgs += " -cl-unsafe-math-optimizations"; }
-  
+// The exponent itself is not a define, but a few coarse properties of it (carry width, chain lengths) are;
+// a program can be reused for any exponent that produces the same list of defines.
+vector<string> makeDefines(const set<string>& flags, cl_device_id id, u32 N, u32 E, u32 WIDTH, u32 SMALL_HEIGHT, u32 MIDDLE) {
   vector<Define> defines =
-    {{"EXP", E},
-     {"WIDTH", WIDTH},
+    {{"WIDTH", WIDTH},
      {"SMALL_HEIGHT", SMALL_HEIGHT},
      {"MIDDLE", MIDDLE},
     };
@@ -301,20 +383,8 @@ cl_program compile(const Args& args, cl_context context, cl_device_id id, u32 N,
   if (max_accuracy) { defines.push_back({"MAX_ACCURACY", 1}); }
   if (ultra_trig) { defines.push_back({"ULTRA_TRIG", 1}); }
 
-  defines.push_back({"WEIGHT_STEP", double(weight(N, E, SMALL_HEIGHT * MIDDLE, 0, 0, 1) - 1)});
-  defines.push_back({"IWEIGHT_STEP", double(invWeight(N, E, SMALL_HEIGHT * MIDDLE, 0, 0, 1) - 1)});
-
-  vector<double> iWeights;
-  vector<double> fWeights;
-  for (u32 i = 0; i < CARRY_LEN; ++i) {
-    iWeights.push_back(invWeight(N, E, SMALL_HEIGHT * MIDDLE, 0, 0, 2*i) - 1);
-    fWeights.push_back(weight(N, E, SMALL_HEIGHT * MIDDLE, 0, 0, 2*i) - 1);
-  }
-  defines.push_back({"IWEIGHTS", iWeights});
-  defines.push_back({"FWEIGHTS", fWeights});
-  
   string clSource = CL_SOURCE;
-  for (const string& flag : args.flags) {
+  for (const string& flag : flags) {
     auto pos = flag.find('=');
     string label = (pos == string::npos) ? flag : flag.substr(0, pos);
     if (clSource.find(label) == string::npos) {
@@ -330,18 +400,47 @@ cl_program compile(const Args& args, cl_context context, cl_device_id id, u32 N,
 
   vector<string> strDefines;
   strDefines.insert(strDefines.begin(), defines.begin(), defines.end());
+  return strDefines;
+}
+
+string buildArgs(const Args& args, u32 N) {
+  string clArgs = args.dump.empty() ? ""s : (" -save-temps="s + args.dump + "/" + numberK(N));
+  if (!args.safeMath) { clArgs += " -cl-unsafe-math-optimizations"; }
+  return clArgs;
+}
+
+cl_program compile(const Args& args, cl_context context, cl_device_id id, u32 N, const vector<string>& strDefines) {
+  string clArgs = buildArgs(args, N);
 
   cl_program program{};
-  if (args.binaryFile.empty()) {
+  if (!args.binaryFile.empty()) {
+    program = loadBinary(context, id, args.binaryFile);
+  } else if (args.kernelCacheDir.empty() || !args.dump.empty()) {
     program = compile(context, id, CL_SOURCE, clArgs, strDefines);
   } else {
-    program = loadBinary(context, id, args.binaryFile);
+    KernelCache cache{args.kernelCacheDir, args.kernelCacheSize};
+    string key = KernelCache::makeKey(id, CL_SOURCE, clArgs, strDefines);
+    program = cache.load(context, id, key);
+    if (!program && (program = compile(context, id, CL_SOURCE, clArgs, strDefines))) { cache.save(program, key); }
   }
   if (!program) { throw "OpenCL compilation"; }
   // dumpBinary(program, "dump.bin");
   return program;
 }
 
+// Compiles the program into the kernel cache if it isn't there yet, so that a later compile() is fast.
+void warmKernelCache(const Args& args, cl_device_id id, u32 N, const vector<string>& strDefines) {
+  if (!args.binaryFile.empty() || args.kernelCacheDir.empty() || !args.dump.empty()) { return; }
+  
+  string clArgs = buildArgs(args, N);
+  KernelCache cache{args.kernelCacheDir, args.kernelCacheSize};
+  string key = KernelCache::makeKey(id, CL_SOURCE, clArgs, strDefines);
+  if (cache.contains(key)) { return; }
+
+  Context context{id};
+  if (Holder<cl_program> program{compile(context.get(), id, CL_SOURCE, clArgs, strDefines)}) { cache.save(program.get(), key); }
+}
+
 float2 fixup(float hw, f128 ref, double& errBits) {
   f128 r = ref - hw;
   float c1 = r;
@@ -359,29 +458,38 @@ float2 fixup(float hw, f128 ref, double& errBits) {
 
 vector<pair<float2, float2>> trigFixup(const vector<float2>& hwTrig, const vector<pair<f128, f128>>& ref) {
   assert(hwTrig.size() == ref.size());
-  vector<pair<float2, float2>> fixupVect;
+  vector<pair<float2, float2>> fixupVect(ref.size());
 
   double bitsCos = 1000, bitsSin = 1000;
+  std::mutex mut;
   
-  for (u32 i = 0; i < ref.size(); ++i) {
-    auto [hwCos, hwSin] = hwTrig[i];
-    auto [refCos, refSin] = ref[i];    
-    fixupVect.push_back({fixup(hwCos, refCos, bitsCos), fixup(hwSin, refSin, bitsSin)});
-  }
+  parallelFor(ref.size(), [&](u32 begin, u32 end) {
+    double chunkCos = 1000, chunkSin = 1000;
+    for (u32 i = begin; i < end; ++i) {
+      auto [hwCos, hwSin] = hwTrig[i];
+      auto [refCos, refSin] = ref[i];
+      fixupVect[i] = {fixup(hwCos, refCos, chunkCos), fixup(hwSin, refSin, chunkSin)};
+    }
+    std::unique_lock lock(mut);
+    bitsCos = std::min(bitsCos, chunkCos);
+    bitsSin = std::min(bitsSin, chunkSin);
+  });
   log("trig table : %u points, cos %.2f bits, sin %.2f bits\n", u32(fixupVect.size()), bitsCos, bitsSin);
   return fixupVect;
 }
 
 }
 
-Gpu::Gpu(const Args& args, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
-         cl_device_id device, bool timeKernels, bool useLongCarry)
-  : Gpu{args, E, W, BIG_H, SMALL_H, nW, nH, device, timeKernels, useLongCarry, genWeights(E, W, BIG_H, nW)}
-{}
+static bool needsLongCarry(const Args& args, float bitsPerWord) {
+  return (bitsPerWord < 10.5f) || (args.carry == Args::CARRY_LONG);
+}
+
+// The number of words per thread for an FFT of the given width or height.
+static u32 wordsPerThread(u32 size) { return (size == 1024 || size == 256) ? 4 : 8; }
 
 using float2 = pair<float, float>;
 
-Gpu::Gpu(const Args& args, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
+Gpu::Gpu(const Args& args, const set<string>& flags, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
          cl_device_id device, bool timeKernels, bool useLongCarry, Weights&& weights) :
   E(E),
   N(W * BIG_H * 2),
@@ -390,12 +498,17 @@ Gpu::Gpu(const Args& args, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
   nH(nH),
   bufSize(N * sizeof(double)),
   WIDTH(W),
+  BIG_H(BIG_H),
+  SMALL_H(SMALL_H),
   useLongCarry(useLongCarry),
   timeKernels(timeKernels),
+  timeSample(timeKernels ? 0 : args.timeSample),
   device(device),
   context{device},
-  program(compile(args, context.get(), device, N, E, W, SMALL_H, BIG_H / SMALL_H, nW)),
-  queue(Queue::make(context, timeKernels, args.cudaYield)),
+  flags{flags},
+  defines{makeDefines(flags, device, N, E, W, SMALL_H, BIG_H / SMALL_H)},
+  program(compile(args, context.get(), device, N, defines)),
+  queue(Queue::make(context, timeKernels, args.cudaYield, timeSample)),
 
   // Specifies size in number of workgroups
 #define LOAD(name, nGroups) name{program.get(), queue, device, nGroups, #name}
@@ -429,6 +542,11 @@ Gpu::Gpu(const Args& args, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
   LOAD(isNotZero, 256),
   LOAD(isEqual, 256),
   LOAD(sum64, 256),
+  LOAD(writeWeights, 32),
+  LOAD(compactSigns, N / 32 / 256),
+  LOAD(compactCarries, 1),
+  LOAD(compactWords, N / 32 / 256),
+  LOAD(expandWords, N / 32 / 256),
 #undef LOAD_WS
 #undef LOAD
 
@@ -447,6 +565,8 @@ Gpu::Gpu(const Args& args, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
   bufCarryMulMax{queue, "carryMulMax", 8},
   bufSmallOut{queue, "smallOut", 256},
   bufSumOut{queue, "sumOut", 1},
+  bufCompact{queue, "compact", N / 32 * 20 + 2}, // at most 20 bits per word
+  bufCompactSigns{queue, "compactSigns", N / 32},
   buf1{queue, "buf1", N},
   buf2{queue, "buf2", N},
   buf3{queue, "buf3", N},
@@ -472,27 +592,8 @@ Gpu::Gpu(const Args& args, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
   
   // log("%lx\n", as<u64>(1.0));
   */
-  
-  carryFused.setFixedArgs(   2, bufCarry, bufReady, bufTrigW, bufBits, bufRoundoff, bufCarryMax);
-  carryFusedMul.setFixedArgs(2, bufCarry, bufReady, bufTrigW, bufBits, bufRoundoff, bufCarryMulMax);
-  fftP.setFixedArgs(2, bufTrigW);
-  fftW.setFixedArgs(2, bufTrigW);
-  fftHin.setFixedArgs(2, bufTrigH);
-  fftHout.setFixedArgs(1, bufTrigH);
-  fftMiddleIn.setFixedArgs(2, bufTrigM);
-  fftMiddleOut.setFixedArgs(2, bufTrigM);
-    
-  carryA.setFixedArgs(2, bufCarry, bufBitsC, bufRoundoff, bufCarryMax);
-  carryM.setFixedArgs(2, bufCarry, bufBitsC, bufRoundoff, bufCarryMulMax);
-  carryB.setFixedArgs(1, bufCarry, bufBitsC);
 
-  tailFusedMulDelta.setFixedArgs(4, bufTrigH, bufTrigH);
-  tailFusedMulLow.setFixedArgs(3, bufTrigH, bufTrigH);
-  tailFusedMul.setFixedArgs(3, bufTrigH, bufTrigH);
-  tailMulLowLow.setFixedArgs(2, bufTrigH);
-  
-  tailFusedSquare.setFixedArgs(2, bufTrigH, bufTrigH);
-  tailSquareLow.setFixedArgs(2, bufTrigH, bufTrigH);
+  setFixedArgs();
 
   bufReady.zero();
   bufRoundoff.zero();
@@ -510,43 +611,120 @@ Gpu::Gpu(const Args& args, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
     readTrigSH = bufSH.read();
     readTrigBH = bufBH.read();
     readTrigN = bufN.read();
-    auto vSh = trigFixup(readTrigSH, makeTrig<f128>(2 * SMALL_H));
-    auto vBh = trigFixup(readTrigBH, makeTrig<f128>(BIG_H));
-    auto vN  = trigFixup(readTrigN, makeTrig<f128>(hN));
+    auto refSh = cachedTrig(args, 2 * SMALL_H);
+    auto refBh = cachedTrig(args, BIG_H);
+    auto refN  = cachedTrig(args, hN);
+    auto vSh = trigFixup(readTrigSH, refSh);
+    auto vBh = trigFixup(readTrigBH, refBh);
+    auto vN  = trigFixup(readTrigN, refN);
 
     Kernel{program.get(), queue, device, 32, "writeGlobals"}(ConstBuffer{context, "sp1", vSh},
                                                              ConstBuffer{context, "sp2", vBh},
                                                              ConstBuffer{context, "sp3", vN},
                                                              
-                                                             ConstBuffer{context, "dp1", makeTrig<double>(2 * SMALL_H)},
-                                                             ConstBuffer{context, "dp2", makeTrig<double>(BIG_H)},
-                                                             ConstBuffer{context, "dp3", makeTrig<double>(hN)},
-                                                             ConstBuffer{context, "dp4", makeTinyTrig<double>(W, hN)},
-
-                                                             ConstBuffer{context, "w2", weights.threadWeightsIF},
-                                                             ConstBuffer{context, "w3", weights.carryWeightsIF}
+                                                             ConstBuffer{context, "dp1", toDouble(refSh)},
+                                                             ConstBuffer{context, "dp2", toDouble(refBh)},
+                                                             ConstBuffer{context, "dp3", toDouble(refN)},
+                                                             ConstBuffer{context, "dp4", makeTinyTrig<double>(W, hN)}
                                                              );
   }
+  uploadWeights(weights);
 
   finish();
   
   program.reset();
 }
 
+void Gpu::setFixedArgs() {
+  carryFused.setFixedArgs(   2, bufCarry, bufReady, bufTrigW, bufBits, bufRoundoff, bufCarryMax);
+  carryFusedMul.setFixedArgs(2, bufCarry, bufReady, bufTrigW, bufBits, bufRoundoff, bufCarryMulMax);
+  fftP.setFixedArgs(2, bufTrigW);
+  fftW.setFixedArgs(2, bufTrigW);
+  fftHin.setFixedArgs(2, bufTrigH);
+  fftHout.setFixedArgs(1, bufTrigH);
+  fftMiddleIn.setFixedArgs(2, bufTrigM);
+  fftMiddleOut.setFixedArgs(2, bufTrigM);
+    
+  carryA.setFixedArgs(2, bufCarry, bufBitsC, bufRoundoff, bufCarryMax);
+  carryM.setFixedArgs(2, bufCarry, bufBitsC, bufRoundoff, bufCarryMulMax);
+  carryB.setFixedArgs(1, bufCarry, bufBitsC);
+
+  tailFusedMulDelta.setFixedArgs(4, bufTrigH, bufTrigH);
+  tailFusedMulLow.setFixedArgs(3, bufTrigH, bufTrigH);
+  tailFusedMul.setFixedArgs(3, bufTrigH, bufTrigH);
+  tailMulLowLow.setFixedArgs(2, bufTrigH);
+  
+  tailFusedSquare.setFixedArgs(2, bufTrigH, bufTrigH);
+  tailSquareLow.setFixedArgs(2, bufTrigH, bufTrigH);
+}
+
+void Gpu::uploadWeights(const Weights& weights) {
+  writeWeights(E,
+               ConstBuffer{context, "w2", weights.threadWeightsIF},
+               ConstBuffer{context, "w3", weights.carryWeightsIF},
+               weights.weightStep, weights.iweightStep,
+               ConstBuffer{context, "fw", weights.fWeights},
+               ConstBuffer{context, "iw", weights.iWeights});
+}
+
+bool Gpu::retarget(u32 newE, Weights* preWeights) {
+  if (newE == E) { return true; }
+  
+  u32 MIDDLE = BIG_H / SMALL_H;
+  float bitsPerWord = newE / float(N);
+  if (bitsPerWord > 20 || bitsPerWord < FFTConfig::MIN_BPW
+      || useLongCarry != needsLongCarry(args, bitsPerWord)
+      || defines != makeDefines(flags, device, N, newE, WIDTH, SMALL_H, MIDDLE)) {
+    return false;
+  }
+
+  E = newE;
+  Weights weights = preWeights ? std::move(*preWeights) : makeWeights(args, E, WIDTH, BIG_H, nW);
+  bufBits = ConstBuffer{context, "bits", weights.bitsCF};
+  bufBitsC = ConstBuffer{context, "bitsC", weights.bitsC};
+  setFixedArgs();
+  uploadWeights(weights);
+
+  bufReady.zero();
+  bufRoundoff.zero();
+  bufCarryMax.zero();
+  bufCarryMulMax.zero();
+  finish();
+  log("%u FFT: %s reused (%.2f bpw)\n", E, numberK(N).c_str(), bitsPerWord);
+  return true;
+}
+
 vector<Buffer<i32>> Gpu::makeBufVector(u32 size) {
   vector<Buffer<i32>> r;
   for (u32 i = 0; i < size; ++i) { r.emplace_back(queue, "vector", N); }
   return r;
 }
 
-static FFTConfig getFFTConfig(u32 E, string fftSpec) {
-  if (fftSpec.empty()) {
-    vector<FFTConfig> configs = FFTConfig::genConfigs();
-    for (FFTConfig c : configs) { if (c.maxExp() >= E) { return c; } }
-    log("No FFT for exponent %u\n", E);
-    throw "No FFT for exponent";
+static string flagLabel(const string& flag) { return flag.substr(0, flag.find('=')); }
+
+// The FFT and the -use flags for E: from -fft if set, otherwise from the tuning database, otherwise the first FFT that fits.
+// The -use flags from the command line take precedence over the tuned ones.
+static pair<FFTConfig, set<string>> chooseFFT(u32 E, const Args& args) {
+  if (!args.fftSpec.empty()) { return {FFTConfig::fromSpec(args.fftSpec), args.flags}; }
+
+  if (optional<TunedFFT> tuned = findTuned(E)) {
+    set<string> flags = args.flags;
+    // makeDefines() forces CARRY64 for the larger exponents, so an older tune.txt entry's CARRY32 would not compile.
+    bool carry64 = FFTConfig::getMaxCarry32(tuned->config.fftSize(), E) > 0x6C00;
+    for (const string& flag : tuned->flags) {
+      string label = flagLabel(flag);
+      if (carry64 && label == "CARRY32") { continue; }
+      if (std::none_of(args.flags.begin(), args.flags.end(), [&label](const string& f) { return flagLabel(f) == label; })) {
+        flags.insert(flag);
+      }
+    }
+    return {tuned->config, flags};
   }
-  return FFTConfig::fromSpec(fftSpec);
+  
+  vector<FFTConfig> configs = FFTConfig::genConfigs();
+  for (FFTConfig c : configs) { if (c.maxExp() >= E) { return {c, args.flags}; } }
+  log("No FFT for exponent %u\n", E);
+  throw "No FFT for exponent";
 }
 
 vector<int> Gpu::readSmall(Buffer<int>& buf, u32 start) {
@@ -609,18 +787,19 @@ Words Gpu::fold(vector<Buffer<int>>& bufs) {
   return {};
 }
 
-unique_ptr<Gpu> Gpu::make(u32 E, const Args &args) {
-  FFTConfig config = getFFTConfig(E, args.fftSpec);
+unique_ptr<Gpu> Gpu::make(u32 E, const Args &args, Weights* preWeights) {
+  auto [config, flags] = chooseFFT(E, args);
   u32 WIDTH        = config.width;
   u32 SMALL_HEIGHT = config.height;
   u32 MIDDLE       = config.middle;
   u32 N = WIDTH * SMALL_HEIGHT * MIDDLE * 2;
 
-  u32 nW = (WIDTH == 1024 || WIDTH == 256) ? 4 : 8;
-  u32 nH = (SMALL_HEIGHT == 1024 || SMALL_HEIGHT == 256) ? 4 : 8;
+  u32 nW = wordsPerThread(WIDTH);
+  u32 nH = wordsPerThread(SMALL_HEIGHT);
 
   float bitsPerWord = E / float(N);
   log("FFT: %s %s (%.2f bpw)\n", numberK(N).c_str(), config.spec().c_str(), bitsPerWord);
+  if (flags != args.flags) { log("using tuned flags for this FFT\n"); }
 
   if (bitsPerWord > 20) {
     log("FFT size too small for exponent (%.2f bits/word).\n", bitsPerWord);
@@ -634,17 +813,123 @@ unique_ptr<Gpu> Gpu::make(u32 E, const Args &args) {
 
   // log("Expected maximum carry32: %X0000\n", config.getMaxCarry32(N, E));
 
-  bool useLongCarry = (bitsPerWord < 10.5f) || (args.carry == Args::CARRY_LONG);
+  bool useLongCarry = needsLongCarry(args, bitsPerWord);
 
   if (useLongCarry) { log("using long carry kernels\n"); }
 
   bool timeKernels = args.timeKernels;
 
-  return make_unique<Gpu>(args, E, WIDTH, SMALL_HEIGHT * MIDDLE, SMALL_HEIGHT, nW, nH,
-                          getDevice(args.device), timeKernels, useLongCarry);
+  u32 BIG_H = SMALL_HEIGHT * MIDDLE;
+  return unique_ptr<Gpu>{new Gpu{args, flags, E, WIDTH, BIG_H, SMALL_HEIGHT, nW, nH, getDevice(args.device), timeKernels, useLongCarry,
+                                 preWeights ? std::move(*preWeights) : makeWeights(args, E, WIDTH, BIG_H, nW)}};
+}
+
+GpuPrefetch Gpu::prefetch(u32 E, const Args &args) {
+  Timer timer;
+  auto [config, flags] = chooseFFT(E, args);
+  u32 N = config.fftSize();
+  float bitsPerWord = E / float(N);
+  if (bitsPerWord > 20 || bitsPerWord < FFTConfig::MIN_BPW) { return {}; }
+
+  u32 BIG_H = config.height * config.middle;
+  auto weights = std::make_shared<Weights>(makeWeights(args, E, config.width, BIG_H, wordsPerThread(config.width)));
+
+  cl_device_id device = getDevice(args.device);
+  warmKernelCache(args, device, N, makeDefines(flags, device, N, E, config.width, config.height, config.middle));
+  log("%u prefetched in %.1fs\n", E, timer.elapsedSecs());
+  return {E, config.spec(), std::move(weights)};
+}
+
+unique_ptr<Gpu> Gpu::reuseOrMake(unique_ptr<Gpu> gpu, u32 E, const Args &args, GpuPrefetch* prefetched) {
+  auto [config, flags] = chooseFFT(E, args);
+  Weights* preWeights = (prefetched && prefetched->E == E && prefetched->fftSpec == config.spec()) ? prefetched->weights.get() : nullptr;
+  
+  if (gpu) {
+    if (config.width == gpu->WIDTH && config.height == gpu->SMALL_H && config.height * config.middle == gpu->BIG_H
+        && flags == gpu->flags && gpu->retarget(E, preWeights)) {
+      return gpu;
+    }
+    gpu.reset(); // release the old buffers before allocating the new ones
+  }
+  return make(E, args, preWeights);
 }
 
 vector<u32> Gpu::readAndCompress(ConstBuffer<int>& buf)  {
+  TraceSpan span{"readAndCompress"};
+  if (args.pack == Args::PACK_HOST) { return readAndCompressHost(buf); }
+
+  vector<u32> words = readAndCompressGpu(buf);
+  if (args.pack == Args::PACK_CHECK && words != readAndCompressHost(buf)) {
+    log("GPU packing differs from the host\n");
+    throw "GPU packing mismatch";
+  }
+  return words;
+}
+
+// Packs on the GPU, so only about E/8 bytes are read back.
+vector<u32> Gpu::readAndCompressGpu(ConstBuffer<int>& buf)  {
+  for (int nRetry = 0; nRetry < 3; ++nRetry) {
+    vector<u32> words;
+    vector<u64> sum;
+    readCompactAsync(buf, words, sum);
+    finish();
+    optional<Words> data = unpackCompact(E, std::move(words), sum[0]);
+    
+    if (!data || (data->empty() && nRetry == 0)) {
+      log("GPU -> Host read #%d failed\n", nRetry);
+    } else {
+      if (data->empty()) { log("Read ZERO\n"); }
+      return *data;
+    }
+  }
+  throw "Persistent read errors: GPU->Host";
+}
+
+void Gpu::readCompactAsync(ConstBuffer<int>& buf, vector<u32>& words, vector<u64>& sum) {
+  const u32 nWords = (E - 1) / 32 + 1;
+  const u32 nRead = (nWords + 2) & ~1u; // with the borrow word, rounded up for sum64
+  assert(nRead <= bufCompact.size);
+
+  transposeOut(bufAux, buf);
+  bufCompact.zero(nRead);
+  compactSigns(bufCompactSigns, bufAux);
+  compactCarries(bufCompact, E, bufCompactSigns);
+  compactWords(bufCompact, E, bufCompactSigns, bufAux);
+  sum64(bufSumOut, u32(nRead * sizeof(u32)), bufCompact);
+  bufSumOut.readAsync(sum);
+  bufCompact.readAsync(words, nRead);
+}
+
+optional<Words> Gpu::unpackCompact(u32 E, vector<u32> words, u64 expectedSum) {
+  const u32 nWords = (E - 1) / 32 + 1;
+  assert(words.size() > nWords && words.size() % 2 == 0);
+  
+  u64 sum = 0;
+  bool allZero = true;
+  for (u32 i = 0; i < words.size(); i += 2) {
+    u64 v = words[i] | (u64(words[i + 1]) << 32);
+    sum += v;
+    allZero &= !v;
+  }
+
+  if (sum != expectedSum) {
+    log("GPU -> Host read checksum mismatch (%x vs %x)\n", unsigned(sum), unsigned(expectedSum));
+    return {};
+  }
+  if (allZero) { return Words{}; }
+  
+  // The borrow out of the top bit wraps around to bit 0, as in compactBits().
+  int carry = int(words[nWords]);
+  words.resize(nWords);
+  for (u32 p = 0; carry; ++p) {
+    i64 v = i64(words[p]) + carry;
+    words[p] = v & 0xffffffff;
+    carry = v >> 32;
+  }
+  return words;
+}
+
+vector<u32> Gpu::readAndCompressHost(ConstBuffer<int>& buf)  {
   for (int nRetry = 0; nRetry < 3; ++nRetry) {
     sum64(bufSumOut, u32(buf.size * sizeof(int)), buf);
     
@@ -748,13 +1033,14 @@ void Gpu::writeState(const vector<u32> &check, u32 blockSize, Buffer<double>& bu
 }
   
 bool Gpu::doCheck(u32 blockSize, Buffer<double>& buf1, Buffer<double>& buf2, Buffer<double>& buf3) {
+  TraceSpan span{"doCheck"};
   modSqLoopMul3(bufAux, bufCheck, 0, blockSize);  
   modMul(bufCheck, bufCheck, bufData, buf1, buf2, buf3);  
   return equalNotZero(bufCheck, bufAux);
 }
 
 void Gpu::logTimeKernels() {
-  if (timeKernels) {
+  if (timeKernels || timeSample) {
     Queue::Profile profile = queue->getProfile();
     queue->clearProfile();
     double total = 0;
@@ -767,7 +1053,11 @@ void Gpu::logTimeKernels() {
             percent, name.c_str(), stats.total * (1e6f / stats.n), stats.n);
       }
     }
-    log("Total time %.3f s\n", total);
+    if (timeSample) {
+      log("Total sampled time %.3f s (1 in %u squarings)\n", total, timeSample);
+    } else {
+      log("Total time %.3f s\n", total);
+    }
   }
 }
 
@@ -795,7 +1085,40 @@ vector<int> Gpu::readOut(ConstBuffer<int> &buf) {
   return bufAux.read();
 }
 
-void Gpu::writeIn(Buffer<int>& buf, const vector<u32>& words) { writeIn(buf, expandBits(words, N, E)); }
+void Gpu::writeIn(Buffer<int>& buf, const vector<u32>& words) {
+  if (args.pack == Args::PACK_HOST) {
+    writeIn(buf, expandBits(words, N, E));
+    return;
+  }
+  
+  writeInGpu(buf, words, true);
+  if (args.pack == Args::PACK_CHECK && bufAux.read() != expandBits(words, N, E)) {
+    log("GPU expansion differs from the host\n");
+    throw "GPU expansion mismatch";
+  }
+}
+
+// Uploads the packed words (about E/8 bytes) and expands them on the GPU.
+void Gpu::writeInGpu(Buffer<int>& buf, const vector<u32>& words, bool blocking) {
+  assert(words.size() == (E - 1) / 32 + 1);
+  assert(words.size() < bufCompact.size);
+  bufCompact.zero(words.size() + 1); // expandWords() reads one word past the end
+  if (blocking) {
+    bufCompact.write(words);
+  } else {
+    bufCompact.writeAsync(words);
+  }
+  expandWords(bufAux, E, bufCompact);
+  transposeIn(buf, bufAux);
+}
+
+void Gpu::writeInAsync(Buffer<int>& buf, const vector<u32>& words) {
+  if (args.pack == Args::PACK_GPU) {
+    writeInGpu(buf, words, false);
+  } else {
+    writeIn(buf, words);
+  }
+}
 
 void Gpu::writeIn(Buffer<int>& buf, const vector<i32>& words) {
   bufAux.write(words);
@@ -905,33 +1228,99 @@ void Gpu::exponentiateLow(Buffer<double>& out, const Buffer<double>& base, u64 e
 
 namespace {
 bool testBit(u64 x, int bit) { return x & (u64(1) << bit); }
+
+// The bits [low, high] of x.
+u32 bitsAt(u64 x, int high, int low) { return (x >> low) & ((u64(1) << (high - low + 1)) - 1); }
+
+// The sliding-window size that minimizes the number of multiplications, counting the precomputation
+// of the odd powers (one squaring and 2^(w-1) - 1 multiplications). A window of 1 is binary exponentiation.
+u32 bestWindow(u64 exp, u32 maxWindow) {
+  u32 nBits = 64 - __builtin_clzll(exp);
+  u32 best = 1;
+  float bestCost = __builtin_popcountll(exp) - 1;
+  for (u32 w = 2; w <= maxWindow && w < nBits; ++w) {
+    float cost = (1u << (w - 1)) + float(nBits) / (w + 1);
+    if (cost < bestCost) {
+      best = w;
+      bestCost = cost;
+    }
+  }
+  return best;
+}
+
 }
 
-// See "left-to-right binary exponentiation" on wikipedia
+// Left-to-right sliding-window exponentiation. The odd powers base^3 .. base^(2^w - 1) are precomputed in "low"
+// position, so that each window of up to w bits costs one multiplication. The window size is limited by the
+// GPU memory available for the powers. The power buffers are freed at the end unless a PowerScope keeps them.
 void Gpu::exponentiateCore(Buffer<double>& out, const Buffer<double>& base, u64 exp, Buffer<double>& tmp) {
   assert(exp >= 2);
 
-  tailSquareLow(tmp, base);
-  tH(out, tmp);
-  
-  int p = 63;
-  while (!testBit(exp, p)) { --p; }
+  u64 nFree = AllocTrac::availableBytes() / (N * sizeof(double)) + powerBufs.size();
+  u32 maxWindow = 1;
+  while (maxWindow < 6 && (1u << maxWindow) + 1 <= nFree) { ++maxWindow; } // keep two buffers spare
+  u32 w = bestWindow(exp, maxWindow);
+
+  vector<Buffer<double>>& powers = powerBufs; // powers[i] == base^(2*i + 3)
+  if (w > 1) {
+    u32 n = (1u << (w - 1)) - 1;
+    while (powers.size() < n) { powers.emplace_back(queue, "pow", N); }
+
+    // base^2 in "W" position, kept in the last power buffer until that one is computed.
+    Buffer<double>& sq = powers[n - 1];
+    tailSquareLow(tmp, base);
+    tH(out, tmp);
+    doCarry(tmp, out);
+    tW(sq, tmp);
+    
+    for (u32 i = 0; i < n; ++i) {
+      tailFusedMulLow(tmp, sq, i ? powers[i - 1] : base);
+      tH(out, tmp);
+      doCarry(tmp, out);
+      tW(out, tmp);
+      fftHin(powers[i], out);
+    }
+  }
+  auto power = [&](u32 v) -> const Buffer<double>& { return v == 1 ? base : powers[(v - 3) / 2]; };
   
-  for (--p; ; --p) {
-    if (testBit(exp, p)) {
+  int i = 63;
+  while (!testBit(exp, i)) { --i; }
+
+  // The leading window stops above bit 0 so that at least one squaring follows it;
+  // that first squaring reads the power directly.
+  int j = std::max(i - int(w) + 1, 1);
+  while (!testBit(exp, j)) { ++j; }
+  tailSquareLow(tmp, power(bitsAt(exp, i, j)));
+  tH(out, tmp);
+  bool squared = true;
+
+  for (i = j - 1; i >= 0; i = j - 1) {
+    j = i;
+    if (testBit(exp, i)) {
+      j = std::max(i - int(w) + 1, 0);
+      while (!testBit(exp, j)) { ++j; }
+    }
+
+    for (int k = i; k >= j; --k) {
+      if (squared) {
+        squared = false;
+      } else {
+        doCarry(tmp, out);
+        tW(out, tmp);
+        tailSquare(tmp, out);
+        tH(out, tmp);
+      }
+    }
+
+    if (testBit(exp, i)) {
       doCarry(tmp, out);
       tW(out, tmp);
-      tailFusedMulLow(tmp, out, base);
+      tailFusedMulLow(tmp, out, power(bitsAt(exp, i, j)));
       tH(out, tmp);
     }
-    
-    if (!p) { break; }
-
-    doCarry(tmp, out);
-    tW(out, tmp);
-    tailSquare(tmp, out);
-    tH(out, tmp);
   }
+
+  if (!nPowerScopes) { powers.clear(); }
 }
 
 // does either carrryFused() or the expanded version depending on useLongCarry
@@ -947,6 +1336,9 @@ void Gpu::doCarry(Buffer<double>& out, Buffer<double>& in) {
 }
 
 void Gpu::coreStep(Buffer<int>& out, Buffer<int>& in, bool leadIn, bool leadOut, bool mul3) {
+  bool sample = timeSample && ++nSteps % timeSample == 0;
+  if (sample) { queue->setSampling(true); }
+  
   if (leadIn) {
     fftP(buf2, in);
     tW(buf1, buf2);    
@@ -965,6 +1357,8 @@ void Gpu::coreStep(Buffer<int>& out, Buffer<int>& in, bool leadIn, bool leadOut,
     if (mul3) { carryFusedMul(buf2, buf1); } else { carryFused(buf2, buf1); }
     tW(buf1, buf2);
   }
+
+  if (sample) { queue->setSampling(false); }
 }
 
 u32 Gpu::modSqLoop(Buffer<int>& io, u32 from, u32 to) {
@@ -1101,7 +1495,7 @@ template<typename T> float asFloat(T x) { return pun<float>(x); }
 
 }
 
-void Gpu::printRoundoff(u32 E) {
+double Gpu::printRoundoff(u32 E) {
   u32 roundN = bufRoundoff.read(1)[0];
   // fprintf(stderr, "roundN %u\n", roundN);
 
@@ -1118,8 +1512,8 @@ void Gpu::printRoundoff(u32 E) {
   bufCarryMax.write(zero);
   bufCarryMulMax.write(zero);
 
-  if (!roundN) { return; }
-  if (roundN < 2000) { return; }
+  if (!roundN) { return 0; }
+  if (roundN < 2000) { return 0; }
   
 #if DUMP_STATS
   {
@@ -1164,6 +1558,37 @@ void Gpu::printRoundoff(u32 E) {
   log("Carry: N=%u, max %x, avg %x; CarryM: N=%u, max %x, avg %x\n",
       carryN, carryMax, carryAvg, carryMulN, carryMulMax, carryMulAvg);
   // #endif
+  return m;
+}
+
+BenchResult Gpu::benchmark(u32 nIters) {
+  // Starting from 3, the values fill all the bits after about log2(E) squarings.
+  writeData(makeWords(E, 3));
+  modSqLoop(bufData, 0, 200);
+  finish();
+  bufRoundoff.zero();
+  bufCarryMax.zero();
+  bufCarryMulMax.zero();
+
+  // The submit time without skipping the unchanged kernel arguments, for comparison.
+  Kernel::alwaysSetArgs = true;
+  Timer timer;
+  modSqLoop(bufData, 0, nIters);
+  double submitUsPerItAllArgs = timer.elapsedSecs() * 1e6 / nIters;
+  Kernel::alwaysSetArgs = false;
+  finish();
+  queue->clearProfile();
+
+  timer.reset();
+  modSqLoop(bufData, 0, nIters);
+  // Host-side cost of enqueueing the kernels, before waiting for the GPU.
+  double submitUsPerIt = timer.elapsedSecs() * 1e6 / nIters;
+  finish();
+  double usPerIt = timer.elapsedSecs() * 1e6 / nIters;
+
+  Queue::Profile profile = queue->getProfile();
+  queue->clearProfile();
+  return {usPerIt, submitUsPerIt, submitUsPerItAllArgs, printRoundoff(E), profile};
 }
 
 void Gpu::accumulate(Buffer<int>& acc, Buffer<double>& data, Buffer<double>& tmp1, Buffer<double>& tmp2) {
@@ -1299,14 +1724,76 @@ bool Gpu::verifyP2Block(u32 D, const Words& p1Data, u32 block, const Buffer<doub
   return ok;
 }
 
-void Gpu::doP2(Saver* saver, u32 b1, u32 b2, future<string>& gcdFuture, Signal &signal) {
+namespace {
+
+using PlanBlocks = pair<u32, vector<Pm1Plan::BitBlock>>;
+
+// plan.makePlan(), from the table cache when possible. The plan depends only on (B1, B2, D, nBuf),
+// so it is shared by restarts and by the exponents with the same bounds. A plan already made by
+// Pm1Plan::chooseD() is passed in "planned", and is only saved.
+PlanBlocks cachedPlan(const Args& args, Pm1Plan& plan, optional<PlanBlocks> planned) {
+  if (!args.tableCacheDir.empty()) {
+    TableCache cache{args.tableCacheDir, args.tableCacheSize};
+    string name = "p2plan-v" + to_string(Pm1Plan::PLAN_VERSION) + '-' + to_string(plan.B1) + '-' + to_string(plan.B2)
+      + '-' + to_string(plan.D) + '-' + to_string(plan.nBuf);
+    if (planned) {
+      cache.save(name, {plan.encode(planned->first, planned->second)});
+      return std::move(*planned);
+    }
+    if (auto parts = cache.load(name, 1)) {
+      if (auto ret = plan.decode((*parts)[0])) {
+        log("Using the cached P2 plan '%s'\n", name.c_str());
+        return std::move(*ret);
+      }
+      log("P2 plan '%s' invalid, will regenerate\n", name.c_str());
+    }
+    
+    log("Generating P2 plan, please wait..\n");
+    auto ret = plan.makePlan();
+    cache.save(name, {plan.encode(ret.first, ret.second)});
+    return ret;
+  }
+
+  if (planned) { return std::move(*planned); }
+  log("Generating P2 plan, please wait..\n");
+  return plan.makePlan();
+}
+
+// Pm1Plan::chooseD(), from the table cache when possible. The choice depends only on (B1, B2, nBuf),
+// so a restart with the same memory picks the same D again, matching the savefile. When the choice is made here,
+// the plan of the chosen D is returned in "planned".
+u32 cachedD(const Args& args, u32 nBuf, u32 b1, u32 b2, float secsPerMul, optional<PlanBlocks>& planned) {
+  if (args.tableCacheDir.empty()) {
+    auto [D, plan] = Pm1Plan::chooseD(nBuf, b1, b2, secsPerMul);
+    planned = std::move(plan);
+    return D;
+  }
+
+  TableCache cache{args.tableCacheDir, args.tableCacheSize};
+  string name = "p2d-v" + to_string(Pm1Plan::PLAN_VERSION) + '-' + to_string(b1) + '-' + to_string(b2) + '-' + to_string(nBuf);
+  if (auto parts = cache.load(name, 1)) {
+    u32 D = atoi((*parts)[0].c_str());
+    if (std::count(begin(Pm1Plan::D_VALUES), end(Pm1Plan::D_VALUES), D) && Pm1Plan::minBufsFor(D) <= nBuf) { return D; }
+    log("P2 D choice '%s' invalid, will redo\n", name.c_str());
+  }
+
+  auto [D, plan] = Pm1Plan::chooseD(nBuf, b1, b2, secsPerMul);
+  cache.save(name, {to_string(D)});
+  planned = std::move(plan);
+  return D;
+}
+
+}
+
+void Gpu::doP2(Saver* saver, u32 b1, u32 b2, float secsPerMul, future<string>& gcdFuture, Signal &signal) {
   if (!b1) { return; }
   assert(b2 && b2 > b1);
   
   u32 bufSize = N * sizeof(double);
   u32 nBuf = AllocTrac::availableBytes() / bufSize - 5;
-  u32 D = Pm1Plan::getD(args.D, nBuf);
   LogContext pushContext{"P2("s + formatBound(b1) + ',' + formatBound(b2) + ")"};
+  optional<PlanBlocks> planned;
+  u32 D = args.D ? args.D : cachedD(args, nBuf, b1, b2, secsPerMul, planned);
 
   if (saver->loadP2(b2, D, nBuf) == u32(-1)) {
     // log("already finished\n");
@@ -1315,10 +1802,8 @@ void Gpu::doP2(Saver* saver, u32 b1, u32 b2, future<string>& gcdFuture, Signal &
 
   log("D=%u, nBuf=%u\n", D, nBuf);
     
-  Pm1Plan plan{args.D, nBuf, b1, b2};
-  
-  log("Generating P2 plan, please wait..\n");
-  auto [beginBlock, selected] = plan.makePlan();
+  Pm1Plan plan{D, nBuf, b1, b2};
+  auto [beginBlock, selected] = cachedPlan(args, plan, std::move(planned));
   
   bool printStats = args.flags.count("STATS");
 
@@ -1363,7 +1848,10 @@ void Gpu::doP2(Saver* saver, u32 b1, u32 b2, future<string>& gcdFuture, Signal &
   
     assert(!gcdFuture.valid());
     log("Starting P1 GCD\n");
-    gcdFuture = async(launch::async, [E=E, p1Data]() { return GCD(E, p1Data, 1); });
+    gcdFuture = async(launch::async, [E=E, p1Data]() {
+      TraceSpan span{"P1 GCD"};
+      return GCD(E, p1Data, 1);
+    });
   }
 
   vector<u64> blockChecksum(blockBufs.size());
@@ -1536,6 +2024,7 @@ void Gpu::doP2(Saver* saver, u32 b1, u32 b2, future<string>& gcdFuture, Signal &
       assert(!gcdFuture.valid());
       const u32 nextBlock = atEnd ? u32(-1) : (block + 1);
       gcdFuture = async(launch::async, [E=E, b2, D, nBuf, nextBlock, p2Data=std::move(p2Data), saver]() {
+        TraceSpan span{"P2 GCD"};
         string factor = GCD(E, p2Data, 0);
         saver->saveP2(b2, D, nBuf, nextBlock);
         return factor;
@@ -1560,15 +2049,77 @@ JacobiResult doJacobiCheck(u32 E, const Words& data, u32 k) {
   return {jacobi(E, data) == 1, k, res64(data)};
 }
 
+// Saves the proof residues without stalling the squaring loop. The residue is packed on the GPU and read back
+// without blocking; once the queue has been drained, its checksum is verified and it is written to the ProofSet
+// on a background thread. Only one residue is being written at a time.
+class ProofWriter {
+  Gpu& gpu;
+  ProofSet& proofSet;
+  const bool async; // with -pack host the residue is read synchronously, only the write is in the background
+
+  u32 k = 0; // the residue being read back, 0 for none
+  vector<u32> words;
+  vector<u64> sum;
+  
+  std::future<bool> writing;
+  bool failed = false;
+
+  void waitWrite() {
+    if (writing.valid() && !writing.get()) { failed = true; }
+  }
+  
+public:
+  ProofWriter(Gpu& gpu, ProofSet& proofSet, bool async) : gpu{gpu}, proofSet{proofSet}, async{async} {}
+
+  ~ProofWriter() { waitWrite(); }
+
+  void read(Buffer<int>& buf, u32 atK) {
+    assert(!k);
+    k = atK;
+    if (async) {
+      gpu.readCompactAsync(buf, words, sum);
+    } else {
+      words = gpu.readAndCompress(buf);
+    }
+  }
+
+  // Called after a finish(), when the read of the residue has completed.
+  void drained() {
+    if (!k) { return; }
+    waitWrite();
+    
+    writing = std::async(std::launch::async, [this, k = k, words = std::move(words), expectedSum = async ? sum[0] : 0]() mutable {
+      TraceSpan span{"ProofSet::save"};
+      optional<Words> data = async ? Gpu::unpackCompact(proofSet.E, std::move(words), expectedSum) : std::move(words);
+      if (!data || data->empty()) {
+        log("Proof residue %u error%s\n", k, data ? " ZERO" : "");
+        return false;
+      }
+      proofSet.save(k, *data);
+      return true;
+    });
+    words.clear();
+    k = 0;
+  }
+
+  // Waits for the residue being written; false if any residue since the last call was bad.
+  bool ok() {
+    waitWrite();
+    bool wasOk = !failed;
+    failed = false;
+    return wasOk;
+  }
+};
+
 }
 
-fs::path Gpu::saveProof(const Args& args, const ProofSet& proofSet) {
+ProofInfo Gpu::saveProof(const Args& args, const ProofSet& proofSet) {
   Memlock memlock{args.masterDir, u32(args.device)};
   
   for (int retry = 0; retry < 2; ++retry) {
-    Proof proof = proofSet.computeProof(this);
+    Proof proof = proofSet.computeProof(this, u64(args.proofMem) << 20);
     fs::path tmpFile = proof.file(args.proofToVerifyDir);
-    proof.save(tmpFile);
+    ProofInfo info = proof.save(tmpFile);
             
     fs::path proofFile = proof.file(args.proofResultDir);            
     bool doVerify = proofSet.power >= args.proofVerify;
@@ -1578,8 +2129,8 @@ fs::path Gpu::saveProof(const Args& args, const ProofSet& proofSet) {
       error_code noThrow;
       fs::remove(proofFile, noThrow);
       fs::rename(tmpFile, proofFile);
-      log("Proof '%s' generated\n", proofFile.string().c_str());
-      return proofFile;
+      log("Proof '%s' generated, MD5 %s\n", proofFile.string().c_str(), info.md5.c_str());
+      return info;
     }
   }
   throw "bad proof generation";
@@ -1664,7 +2215,8 @@ PRPResult Gpu::isPrimePRP(const Args &args, const Task& task) {
     }
   }
   
-  ProofSet proofSet{args.tmpDir, E, power};
+  ProofSet proofSet{args.tmpDir, E, power, u64(args.proofMem) << 20};
+  ProofWriter proofWriter{*this, proofSet, args.pack != Args::PACK_HOST};
 
   bool isPrime = false;
   IterationTimer iterationTimer{startK};
@@ -1735,13 +2287,11 @@ PRPResult Gpu::isPrimePRP(const Args &args, const Task& task) {
     leadIn = leadOut;    
     
     if (k == persistK) {
-      Words data = readData();
-      if (data.empty()) {
-        log("Data error ZERO\n");
+      if (!proofWriter.ok()) {
         ++nErrors;
         goto reload;
       }
-      proofSet.save(k, data);
+      proofWriter.read(bufData, k);
       persistK = proofSet.next(k);
     }
 
@@ -1771,6 +2321,7 @@ PRPResult Gpu::isPrimePRP(const Args &args, const Task& task) {
     }
 
     u64 res64 = dataResidue(); // implies finish()
+    proofWriter.drained();
     bool doCheck = !res64 || doStop || b1JustFinished || (k % checkStep == 0) || (k >= kEndEnd) || (k - startK == 2 * blockSize);
       
     if (k % 10000 == 0 && !doCheck) {
@@ -1796,6 +2347,13 @@ PRPResult Gpu::isPrimePRP(const Args &args, const Task& task) {
     }
       
     if (doCheck) {
+      // The proof residues must be on disk before the savefile that follows them.
+      if (!proofWriter.ok()) {
+        ++nErrors;
+        goto reload;
+      }
+      proofSet.sync();
+      
       if (printStats) { printRoundoff(E); }
 
       float secsPerIt = iterationTimer.reset(k);
@@ -1831,13 +2389,14 @@ PRPResult Gpu::isPrimePRP(const Args &args, const Task& task) {
         }
 
         if (!doStop && !didP2 && !b1Acc.wantK() && !jacobiFuture.valid()) {
-          doP2(&saver, b1, b2, gcdFuture, signal);
+          // A P2 MUL costs about as much as a PRP iteration.
+          doP2(&saver, b1, b2, secsPerIt, gcdFuture, signal);
           didP2 = true;
         }
           
         if (k >= kEndEnd) {
-          fs::path proofFile = saveProof(args, proofSet);
-          return {"", isPrime, finalRes64, nErrors, proofFile.string()};          
+          ProofInfo proofInfo = saveProof(args, proofSet);
+          return {"", isPrime, finalRes64, nErrors, proofInfo};          
         }
         
       } else {
@@ -5,16 +5,19 @@
 #include "Buffer.h"
 #include "Context.h"
 #include "Queue.h"
+#include "Proof.h"
 
 #include "common.h"
 #include "kernel.h"
 
 #include <vector>
 #include <string>
+#include <set>
 #include <memory>
 #include <variant>
 #include <atomic>
 #include <future>
+#include <optional>
 #include <filesystem>
 
 struct PRPResult;
@@ -38,24 +41,43 @@ struct PRPResult {
   bool isPrime{};
   u64 res64 = 0;
   u32 nErrors = 0;
-  fs::path proofPath{};
+  std::optional<ProofInfo> proof{};
 };
 
 struct Reload {
 };
 
+struct BenchResult {
+  double usPerIt{};
+  double submitUsPerIt{}; // host time spent enqueueing
+  double submitUsPerItAllArgs{}; // the same, with Kernel::alwaysSetArgs
+  double maxRoundoff{}; // only with the STATS flag
+  Queue::Profile profile; // only with timeKernels
+};
+
+// Host-side setup for an exponent, which can be done ahead of time on a background thread.
+struct GpuPrefetch {
+  u32 E{};
+  string fftSpec;
+  std::shared_ptr<struct Weights> weights;
+};
+
 class Gpu {
   friend struct SquaringSet;
   u32 E;
   u32 N;
 
   u32 hN, nW, nH, bufSize;
-  u32 WIDTH;
+  u32 WIDTH, BIG_H, SMALL_H;
   bool useLongCarry;
   bool timeKernels;
+  u32 timeSample; // time one coreStep() in timeSample, 0 for none
+  u32 nSteps = 0;
 
   cl_device_id device;
   Context context;
+  std::set<std::string> flags; // the -use flags, including the tuned ones
+  vector<string> defines; // the program build defines; a different exponent with the same defines can reuse the program
   Holder<cl_program> program;
   QueuePtr queue;
   
@@ -88,6 +110,8 @@ class Gpu {
   Kernel isNotZero;
   Kernel isEqual;
   Kernel sum64;
+  Kernel writeWeights;
+  Kernel compactSigns, compactCarries, compactWords, expandWords;
   
   // Kernel testKernel;
 
@@ -116,10 +140,19 @@ class Gpu {
   HostAccessBuffer<int> bufSmallOut;
   HostAccessBuffer<u64> bufSumOut;
 
+  // The residue packed into E bits, followed by the wrap-around borrow on read (see readAndCompressGpu())
+  // or by a zero word on write (see writeInGpu()).
+  HostAccessBuffer<u32> bufCompact;
+  Buffer<i32> bufCompactSigns;
+
   // Auxilliary big buffers
   Buffer<double> buf1;
   Buffer<double> buf2;
   Buffer<double> buf3;
+
+  // The odd powers of exponentiateCore(), kept for the next call while a PowerScope is alive.
+  vector<Buffer<double>> powerBufs;
+  u32 nPowerScopes = 0;
   
   vector<int> readSmall(Buffer<int>& buf, u32 start);
 
@@ -129,6 +162,7 @@ class Gpu {
   
   vector<int> readOut(ConstBuffer<int> &buf);
   void writeIn(Buffer<int>& buf, const vector<i32> &words);
+  void writeInGpu(Buffer<int>& buf, const vector<u32>& words, bool blocking);
 
   void coreStep(Buffer<int>& out, Buffer<int>& in, bool leadIn, bool leadOut, bool mul3);
   u32 modSqLoop(Buffer<int>& io, u32 from, u32 to);
@@ -154,10 +188,14 @@ class Gpu {
   void tailMul(Buffer<double>& out, Buffer<double>& in, Buffer<double>& inTmp);
   
 
-  Gpu(const Args& args, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
+  Gpu(const Args& args, const std::set<std::string>& flags, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
       cl_device_id device, bool timeKernels, bool useLongCarry, struct Weights&& weights);
 
-  void printRoundoff(u32 E);
+  void setFixedArgs();
+  void uploadWeights(const struct Weights& weights);
+  
+  // Returns the max roundoff, or 0 if there are too few samples.
+  double printRoundoff(u32 E);
 
   // does either carrryFused() or the expanded version depending on useLongCarry
   void doCarry(Buffer<double>& out, Buffer<double>& in);
@@ -174,14 +212,24 @@ class Gpu {
   template<typename Pm1Plan>
   void doP2(Saver* saver, u32 b1, u32 b2, future<string>& gcdFuture, Signal& signal);
 
-  void doP2(Saver* saver, u32 b1, u32 b2, future<string>& gcdFuture, Signal& signal);
+  void doP2(Saver* saver, u32 b1, u32 b2, float secsPerMul, future<string>& gcdFuture, Signal& signal);
   bool verifyP2Checksums(const vector<Buffer<double>>& bufs, const vector<u64>& sums);
   bool verifyP2Block(u32 D, const Words& p1Data, u32 block, const Buffer<double>& bigC, Buffer<int>& bufP2Data);
-  fs::path saveProof(const Args& args, const ProofSet& proofSet);
+  ProofInfo saveProof(const Args& args, const ProofSet& proofSet);
   
 public:
   const Args& args;
 
+  // For a sequence of exponentiations (e.g. the expMul() of a proof): while alive, exponentiateCore()
+  // reuses its power buffers from one call to the next instead of allocating them every time.
+  class PowerScope {
+    Gpu* gpu;
+  public:
+    explicit PowerScope(Gpu* gpu) : gpu{gpu} { ++gpu->nPowerScopes; }
+    ~PowerScope() { if (!--gpu->nPowerScopes) { gpu->powerBufs.clear(); } }
+    PowerScope(const PowerScope&) = delete;
+  };
+
   Words fold(vector<Buffer<int>>& bufs);
   
   void mul(Buffer<int>& out, Buffer<int>& inA, Buffer<int>& inB);
@@ -195,15 +243,36 @@ public:
   void accumulate(Buffer<int>& acc, Buffer<double>& data, Buffer<double>& tmp1, Buffer<double>& tmp2);
 
   
-  static unique_ptr<Gpu> make(u32 E, const Args &args);
+  static unique_ptr<Gpu> make(u32 E, const Args &args, Weights* preWeights = nullptr);
+
+  // Picks the FFT for E, generates its weights and compiles its program into the kernel cache.
+  // Does not touch the GPU queue, so it can run on a background thread while another exponent is in progress.
+  static GpuPrefetch prefetch(u32 E, const Args &args);
+  
+  // Returns "gpu" re-targeted to E if possible, otherwise releases it and makes a new Gpu for E.
+  // The weights from "prefetched" are used if they match.
+  static unique_ptr<Gpu> reuseOrMake(unique_ptr<Gpu> gpu, u32 E, const Args &args, GpuPrefetch* prefetched = nullptr);
+
+  // Switch to a new exponent without rebuilding the program; returns false if the new exponent
+  // needs a different program (or a different FFT), in which case the Gpu is unchanged.
+  bool retarget(u32 E, Weights* preWeights = nullptr);
   static void doDiv9(u32 E, Words& words);
   static bool equals9(const Words& words);
-  
-  Gpu(const Args& args, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
-      cl_device_id device, bool timeKernels, bool useLongCarry);
 
   vector<u32> readAndCompress(ConstBuffer<int>& buf);
+  vector<u32> readAndCompressGpu(ConstBuffer<int>& buf);
+  vector<u32> readAndCompressHost(ConstBuffer<int>& buf);
+
+  // Enqueues the packing of "buf" and non-blocking reads of the packed words and of their checksum.
+  // The outputs are valid after the next finish(), and are checked and unpacked with unpackCompact().
+  void readCompactAsync(ConstBuffer<int>& buf, vector<u32>& words, vector<u64>& sum);
+
+  // Returns nullopt on checksum mismatch, and empty Words if the residue is zero.
+  static std::optional<Words> unpackCompact(u32 E, vector<u32> words, u64 expectedSum);
   void writeIn(Buffer<int>& buf, const vector<u32> &words);
+
+  // Doesn't wait for the upload: "words" must not change until the next finish().
+  void writeInAsync(Buffer<int>& buf, const vector<u32>& words);
   void writeData(const vector<u32> &v) { writeIn(bufData, v); }
   void writeCheck(const vector<u32> &v) { writeIn(bufCheck, v); }
   
@@ -219,6 +288,9 @@ public:
 
   PRPResult isPrimePRP(const Args& args, const Task& task);
 
+  // Times nIters squarings, after a warm-up.
+  BenchResult benchmark(u32 nIters);
+
   // std::variant<string, vector<u32>> factorPM1(u32 E, const Args& args, u32 B1, u32 B2);
   
   u32 getFFTSize() { return N; }
@@ -236,3 +308,18 @@ public:
   Words expExp2(const Words& A, u32 n);
   vector<Buffer<i32>> makeBufVector(u32 size);
 };
+
+// Carried by the worktodo loop from one task to the next: the live Gpu, which is reused when possible,
+// and the setup of the next task, which is prepared on a background thread while the current one runs.
+struct TaskRunner {
+  unique_ptr<Gpu> gpu;
+  std::future<GpuPrefetch> next;
+
+  bool hasPrevious = false;
+  Timer sincePrevious; // since the GPU finished the previous task, to report the idle gap
+
+  ~TaskRunner() {
+    // Don't leave the background setup running past the Gpu.
+    if (next.valid()) { next.wait(); }
+  }
+};
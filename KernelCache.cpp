@@ -0,0 +1,79 @@
+// Copyright Mihai Preda.
+
+#include "KernelCache.h"
+#include "File.h"
+#include "MD5.h"
+
+#include <algorithm>
+
+namespace {
+
+error_code& noThrow() {
+  static error_code dummy;
+  return dummy;
+}
+
+}
+
+string KernelCache::makeKey(cl_device_id id, const string& source, const string& args, const vector<string>& defines) {
+  MD5 h;
+  h.update(getBuildInfo(id));
+  h.update(source);
+  h.update(args);
+  for (const string& d : defines) {
+    h.update(d);
+    h.update(u32(0));  // separator
+  }
+  return std::move(h).finish();
+}
+
+bool KernelCache::contains(const string& key) const { return fs::exists(path(key), noThrow()); }
+
+cl_program KernelCache::load(cl_context context, cl_device_id id, const string& key) {
+  fs::path file = path(key);
+  if (!fs::exists(file, noThrow())) { return nullptr; }
+
+  try {
+    cl_program program = loadBinary(context, id, file.string());
+    fs::last_write_time(file, fs::file_time_type::clock::now(), noThrow()); // mark as recently used
+    log("Using cached kernels '%s'\n", file.string().c_str());
+    return program;
+  } catch (const std::exception& e) {
+    log("Cached kernels '%s' rejected (%s), will recompile\n", file.string().c_str(), e.what());
+    fs::remove(file, noThrow());
+    return nullptr;
+  }
+}
+
+void KernelCache::save(cl_program program, const string& key) {
+  fs::path file = path(key);
+  fs::path tmp = file;
+  tmp += ".tmp";
+  try {
+    fs::create_directories(dir);
+    File::openWrite(tmp).write(getBinary(program));
+    fs::rename(tmp, file);
+  } catch (const std::exception& e) {
+    log("Could not save kernels to '%s' : %s\n", file.string().c_str(), e.what());
+    fs::remove(tmp, noThrow());
+    return;
+  }
+  evict();
+}
+
+// Keep only the most recently used maxEntries binaries.
+void KernelCache::evict() {
+  vector<pair<fs::file_time_type, fs::path>> entries;
+  for (const auto& entry : fs::directory_iterator(dir, noThrow())) {
+    if (entry.is_regular_file() && entry.path().extension() == ".bin") {
+      entries.push_back({fs::last_write_time(entry.path(), noThrow()), entry.path()});
+    }
+  }
+  if (entries.size() <= maxEntries) { return; }
+
+  std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+  for (auto it = entries.begin() + maxEntries; it != entries.end(); ++it) {
+    log("Evicting cached kernels '%s'\n", it->second.string().c_str());
+    fs::remove(it->second, noThrow());
+  }
+}
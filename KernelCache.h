@@ -0,0 +1,34 @@
+// Copyright Mihai Preda.
+
+#pragma once
+
+#include "clwrap.h"
+#include "common.h"
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// On-disk cache of compiled OpenCL programs. The entries are content-addressed: the key is a hash of
+// the device and driver, the CL source, the build args and the list of defines.
+class KernelCache {
+  fs::path dir;
+  u32 maxEntries;
+
+  fs::path path(const string& key) const { return dir / (key + ".bin"); }
+  void evict();
+
+public:
+  static string makeKey(cl_device_id id, const string& source, const string& args, const vector<string>& defines);
+
+  KernelCache(const fs::path& dir, u32 maxEntries) : dir{dir}, maxEntries{maxEntries} {}
+
+  bool contains(const string& key) const;
+
+  // Returns nullptr if not found or if the cached binary is rejected by the driver.
+  cl_program load(cl_context context, cl_device_id id, const string& key);
+
+  void save(cl_program program, const string& key);
+};
@@ -1,26 +1,12 @@
 #include "Pm1Plan.h"
+#include "Sieve.h"
+#include "parallel.h"
 
+#include <algorithm>
+#include <optional>
 #include <tuple>
 #include <array>
 #include <cassert>
-#include <numeric>
-
-vector<bool> Pm1Plan::sieve(u32 B1, u32 B2) {
-  assert(B1 && B1 < B2);
-  vector<bool> bits(B2 + 1);
-  bits[0] = bits[1] = true;
-  for (u32 p = 0; p <= B2; ++p) {
-    while (p <= B2 && bits[p]) { ++p; }
-
-    if (p > B2) { break; }
-
-    if (p <= B1) { bits[p] = true; }
-
-    if (p < (1u << 16) && p * p <= B2) { for (u32 i = p * p; i <= B2; i += p) { bits[i] = true; }}
-  }
-  bits.flip();
-  return bits;
-}
 
 namespace {
 
@@ -31,9 +17,6 @@ template<> constexpr bool isRelPrime<462>(u32 j)  { return j % 2 && j % 3
 template<> constexpr bool isRelPrime<770>(u32 j)  { return j % 2          && j % 5 && j % 7 && j % 11; }
 template<> constexpr bool isRelPrime<2310>(u32 j) { return j % 2 && j % 3 && j % 5 && j % 7 && j % 11; }
 
-template<typename T>
-u32 sum(const T &v) { return accumulate(v.begin(), v.end(), 0); }
-
 // Repeatedly divides "pos" by "F" while it can, keeping it above B1.
 template<u32 F>
 u32 reduce(u32 B1, u32 pos) {
@@ -136,17 +119,15 @@ u32 Pm1Plan::minBufsFor(u32 D) {
 u32 Pm1Plan::reduce(u32 pos) const { return ::reduce(D, B1, pos); }
 template<u32 F> u32 Pm1Plan::reduce(u32 pos) const { return ::reduce<F>(B1, pos); }
 
-Pm1Plan::Pm1Plan(u32 argsD, u32 nBuf, u32 B1, u32 B2, vector<bool>&& primeBits)
+// Lookups in primeBits past B2 (up to the last block) read as not-prime, so makePlan() needs no guard bits.
+Pm1Plan::Pm1Plan(u32 argsD, u32 nBuf, u32 B1, u32 B2, OddBits&& primeBits)
   : nBuf{min(nBuf, MAX_BUFS)}, primeBits{std::move(primeBits)}, D{getD(argsD, nBuf)}, B1{B1}, B2{B2}, jset{makeJset()} {
   assert(nBuf >= 24);
   assert(nBuf >= minBufsFor(D));
   assert(B1 < B2);
-
-  // Extend the primeBits vector with guard zero bits, so that makePlan() does not read past-the-end.
-  for (u32 i = 0; i < 2 * jset.back() + 1; ++i) { this->primeBits.push_back(false); }
 }
 
-Pm1Plan::Pm1Plan(u32 D, u32 nBuf, u32 B1, u32 B2) : Pm1Plan{D, nBuf, B1, B2, sieve(B1, B2)} {
+Pm1Plan::Pm1Plan(u32 D, u32 nBuf, u32 B1, u32 B2) : Pm1Plan{D, nBuf, B1, B2, sieve::oddBits(B1 + 1, B2)} {
 }
 
 vector<u32> Pm1Plan::makeJset() {
@@ -169,7 +150,7 @@ u32 Pm1Plan::primeBefore(u32 b) const {
 }
 
 // Returns the prime hit by "a", or 0.
-u32 Pm1Plan::hit(const vector<bool>& primes, u32 a) {
+u32 Pm1Plan::hit(const OddBits& primes, u32 a) const {
   u32 r = 0;
   return primes[r=a]
     || primes[r=reduce(a)]
@@ -193,23 +174,71 @@ u32 Pm1Plan::lowerBlock(u32 b) const { return (b + jset.back()) / D; }
 // The smallest block that cover "b" (the final block).
 u32 Pm1Plan::upperBlock(u32 b) const { return (b - jset.back()) / D + 1; }
 
+// Calls fun(p1, p2) for the positions of the blocks from the last down to beginBlock, in this order, selecting the
+// position when fun() returns true. fun() may clear the primes it covers, and is not called when neither side hits.
+//
+// The hits of a chunk of blocks are looked up in parallel, then fun() is applied in order. As fun() only ever clears
+// primes, a hit that is still prime when its turn comes is what a sequential scan would have found; only the hits
+// cleared in the meantime are looked up again. So the plan is the same as that of a single-threaded scan.
 template<typename Fun>
-void Pm1Plan::scan(const vector<bool>& primes, u32 beginBlock, vector<BitBlock>& selected, Fun fun) {
-  for (u32 block = selected.size() - 1; block >= beginBlock; --block) {
-    BitBlock& blockBits = selected[block];
-    const u32 base = block * D;
+void Pm1Plan::scan(const OddBits& primes, u32 beginBlock, vector<BitBlock>& selected, Fun fun) {
+  if (hostThreads() == 1) {
+    for (u32 block = selected.size() - 1; block >= beginBlock; --block) {
+      BitBlock& blockBits = selected[block];
+      const u32 base = block * D;
+      for (u32 pos = 0, end = jset.size(); pos < end; ++pos) {
+        u32 j = jset[pos];
+        if (fun(hit(primes, base - j), hit(primes, base + j))) {
+          assert(!blockBits[pos]);
+          blockBits[pos] = true;
+        }
+      }
+    }
+    return;
+  }
+
+  struct Hit {
+    u32 block, pos, p1, p2;
+  };
+  
+  const u32 CHUNK = 8 * 1024; // blocks
+  const u32 MAX_PARTS = 64;
+  
+  for (u32 end = selected.size(); end > beginBlock; ) {
+    u32 begin = max(beginBlock, end > CHUNK ? end - CHUNK : 0);
+    u32 n = end - begin;
+    u32 nParts = min(n, MAX_PARTS);
+    vector<vector<Hit>> parts(nParts);
     
-    for (u32 pos = 0, end = jset.size(); pos < end; ++pos) {
-      u32 j = jset[pos];
-      u32 a = base - j;
-      u32 b = base + j;      
-      u32 p1 = hit(primes, a);
-      u32 p2 = hit(primes, b);
-      if (fun(p1, p2)) {
-        assert(!blockBits[pos]);
-        blockBits[pos] = true;
+    parallelFor(nParts, [&](u32 partBegin, u32 partEnd) {
+      for (u32 part = partBegin; part < partEnd; ++part) {
+        u32 top = end - u64(n) * part / nParts;
+        u32 bottom = end - u64(n) * (part + 1) / nParts;
+        for (u32 block = top; block-- > bottom; ) {
+          const u32 base = block * D;
+          for (u32 pos = 0, nj = jset.size(); pos < nj; ++pos) {
+            u32 j = jset[pos];
+            u32 p1 = hit(primes, base - j);
+            u32 p2 = hit(primes, base + j);
+            if (p1 || p2) { parts[part].push_back({block, pos, p1, p2}); }
+          }
+        }
+      }
+    }, 1);
+
+    for (const auto& part : parts) {
+      for (const Hit& h : part) {
+        u32 j = jset[h.pos];
+        u32 p1 = (!h.p1 || primes[h.p1]) ? h.p1 : hit(primes, h.block * D - j);
+        u32 p2 = (!h.p2 || primes[h.p2]) ? h.p2 : hit(primes, h.block * D + j);
+        if (fun(p1, p2)) {
+          BitBlock& blockBits = selected[h.block];
+          assert(!blockBits[h.pos]);
+          blockBits[h.pos] = true;
+        }
       }
     }
+    end = begin;
   }
 }
 
@@ -221,8 +250,6 @@ pair<u32, vector<Pm1Plan::BitBlock>> Pm1Plan::makePlan() {
   u32 lastPrime = primeBefore(B2 + 1);
   u32 lastBlock   = upperBlock(lastPrime);
   u32 lastCovered = lastBlock * D + jset.back();
-  // log("last %u %u %u %u %u\n", lastPrime, lastBlock, lastCovered, u32(primeBits.size()), jset.back());
-  assert(lastCovered < primeBits.size());
 
   // All primes <= cutValue can be transposed by mulitplying with firstMissingFactor.
   u32 cutValue = lastCovered / firstMissingFactor(D);
@@ -233,9 +260,9 @@ pair<u32, vector<Pm1Plan::BitBlock>> Pm1Plan::makePlan() {
 
   assert(beginBlock < endBlock);
 
-  auto primes = primeBits; // use a copy in which we'll clear the primes as we cover them.
+  OddBits primes = primeBits; // use a copy in which we'll clear the primes as we cover them.
   
-  const u32 nPrimes = sum(primes);
+  const u32 nPrimes = primes.count();
 
   vector<BitBlock> selected(endBlock);
 
@@ -243,21 +270,21 @@ pair<u32, vector<Pm1Plan::BitBlock>> Pm1Plan::makePlan() {
   
   for (int rep = 0; rep < 4; ++rep) {
     
-    vector<bool> oneHit(primes.size()), twoHit(primes.size());
+    OddBits oneHit{B1 + 1, B2}, twoHit{B1 + 1, B2};
 
     scan(primes, beginBlock, selected, [&oneHit, &twoHit](u32 p1, u32 p2) {
       if (p1 && p2) {
         assert(p1 != p2);
         if (oneHit[p1]) {
-          twoHit.at(p1) = true;
+          twoHit.set(p1);
         } else {
-          oneHit.at(p1) = true;
+          oneHit.set(p1);
         }
 
         if (oneHit[p2]) {
-          twoHit.at(p2) = true;
+          twoHit.set(p2);
         } else {
-          oneHit.at(p2) = true;
+          oneHit.set(p2);
         }
       }
       return false;
@@ -266,7 +293,8 @@ pair<u32, vector<Pm1Plan::BitBlock>> Pm1Plan::makePlan() {
     scan(primes, beginBlock, selected, [&primes, &twoHit, &nPair](u32 p1, u32 p2) {
       if (p1 && p2 && (!twoHit[p1] || !twoHit[p2])) {
         ++nPair;
-        primes[p1] = primes[p2] = false;
+        primes.clear(p1);
+        primes.clear(p2);
         return true;
       } else {
         return false;
@@ -277,7 +305,8 @@ pair<u32, vector<Pm1Plan::BitBlock>> Pm1Plan::makePlan() {
   scan(primes, beginBlock, selected, [&primes, &nPair](u32 p1, u32 p2) {
     if (p1 && p2) {
       ++nPair;
-      primes[p1] = primes[p2] = false;
+      primes.clear(p1);
+      primes.clear(p2);
       return true;
     } else {
       return false;
@@ -288,27 +317,174 @@ pair<u32, vector<Pm1Plan::BitBlock>> Pm1Plan::makePlan() {
     if (p1 || p2) {
       assert(!(p1 && p2));
       ++nSingle;
-      primes[p1] = primes[p2] = false;
+      primes.clear(p1 ? p1 : p2);
       return true;
     } else {
       return false;
     }
   });
   
-  assert(sum(primes) == 0);  // all primes are covered.
+  assert(primes.count() == 0);  // all primes are covered.
   assert(nPair * 2 + nSingle == nPrimes);
   
   u32 nBlocks = endBlock - beginBlock;
 
-  // The block transition cost is approximated as 2 MULs.
-  float cost = nPair + nSingle + 2 * nBlocks;
+  // doP2() walks jset twice (the second time to verify) with SquaringSet steps of 2 MULs, covering 2 values of j each.
+  cost = {nPair, nSingle, nBlocks, 2 * jset.back()};
   float percentPaired = 100 * (1 - nSingle / float(nPrimes));
 
   u32 firstPrime = primeAfter(B1);
   log("D=%u: %u primes in [%u, %u]: cost %.2fM (pair: %u, single: %u, (%.0f%% paired), blocks: %u)\n",
       D, nPrimes, firstPrime, lastPrime,
-      cost * (1.0f / 1'000'000),
+      cost.muls() * (1.0f / 1'000'000),
       nPair, nSingle, percentPaired, nBlocks);
   
   return {beginBlock, selected};
 }
+
+Pm1Plan::Chosen Pm1Plan::chooseD(u32 nBuf, u32 B1, u32 B2, float secsPerMul) {
+  // The bounds are scaled down by up to 16x for ranking: that misses the absolute cost by a few percent
+  // (the primes are denser) but keeps the relative costs of the Ds within about 0.3%.
+  const u32 scale = min(16u, B2 / 1'000'000);
+  // The Ds that are estimated within this factor of the best one are planned in full.
+  const float MARGIN = 1.01f;
+
+  vector<pair<float, u32>> estimates;
+  {
+    OddBits primes = scale >= 2 ? sieve::oddBits(B1 / scale + 1, B2 / scale) : OddBits{};
+    for (u32 D : D_VALUES) {
+      if (nBuf < minBufsFor(D)) { continue; }
+      float estimate = 0;
+      if (scale >= 2) {
+        Pm1Plan plan{D, nBuf, B1 / scale, B2 / scale, OddBits{primes}};
+        plan.makePlan();
+        estimate = plan.cost.muls();
+      }
+      estimates.push_back({estimate, D});
+    }
+  }
+  assert(!estimates.empty());
+  std::sort(estimates.begin(), estimates.end());
+
+  OddBits primes = sieve::oddBits(B1 + 1, B2);
+  optional<Chosen> best;
+  u64 bestMuls = 0;
+  for (auto [estimate, D] : estimates) {
+    if (estimate > estimates.front().first * MARGIN) { break; }
+    
+    Pm1Plan plan{D, nBuf, B1, B2, OddBits{primes}};
+    auto ret = plan.makePlan();
+    u64 muls = plan.cost.muls();
+    if (secsPerMul) { log("D=%u: %.2fM MULs, predicted %.0fs\n", D, muls * 1e-6f, muls * secsPerMul); }
+    if (!best || muls < bestMuls) {
+      best = Chosen{D, std::move(ret)};
+      bestMuls = muls;
+    }
+  }
+  log("Chose D=%u (%.2fM MULs)\n", best->D, bestMuls * 1e-6f);
+  return std::move(*best);
+}
+
+namespace {
+
+void putVarint(string& out, u64 x) {
+  while (x >= 0x80) {
+    out.push_back(char(x | 0x80));
+    x >>= 7;
+  }
+  out.push_back(char(x));
+}
+
+// Returns false on truncated input.
+bool getVarint(const string& in, size_t& pos, u64& x) {
+  x = 0;
+  for (u32 shift = 0; pos < in.size() && shift < 64; shift += 7) {
+    u8 b = in[pos++];
+    x |= u64(b & 0x7f) << shift;
+    if (!(b & 0x80)) { return true; }
+  }
+  return false;
+}
+
+}
+
+// Format: varints beginBlock, endBlock, nPos, layout; then either (layout GAPS) varint nSelected followed by
+// the gaps, or (layout BITMAP, when denser) one bit per position.
+enum { LAYOUT_GAPS = 0, LAYOUT_BITMAP = 1 };
+
+string Pm1Plan::encode(u32 beginBlock, const vector<BitBlock>& selected) const {
+  const u32 nPos = jset.size();
+  const u64 nIndex = u64(selected.size() - beginBlock) * nPos;
+  
+  string gaps;
+  u64 nSelected = 0;
+  u64 next = 0; // the smallest index the next selected position may have
+  for (u32 block = beginBlock; block < selected.size(); ++block) {
+    for (u32 pos = 0; pos < nPos; ++pos) {
+      if (selected[block][pos]) {
+        u64 index = u64(block - beginBlock) * nPos + pos;
+        putVarint(gaps, index - next);
+        next = index + 1;
+        ++nSelected;
+      }
+    }
+  }
+  
+  string out;
+  putVarint(out, beginBlock);
+  putVarint(out, selected.size());
+  putVarint(out, nPos);
+  if (gaps.size() < nIndex / 8) {
+    putVarint(out, LAYOUT_GAPS);
+    putVarint(out, nSelected);
+    out += gaps;
+  } else {
+    putVarint(out, LAYOUT_BITMAP);
+    size_t start = out.size();
+    out.resize(start + (nIndex + 7) / 8);
+    for (u32 block = beginBlock; block < selected.size(); ++block) {
+      for (u32 pos = 0; pos < nPos; ++pos) {
+        u64 index = u64(block - beginBlock) * nPos + pos;
+        if (selected[block][pos]) { out[start + index / 8] |= char(1 << (index % 8)); }
+      }
+    }
+  }
+  return out;
+}
+
+std::optional<pair<u32, vector<Pm1Plan::BitBlock>>> Pm1Plan::decode(const string& data) const {
+  size_t pos = 0;
+  u64 beginBlock = 0, endBlock = 0, nPos = 0, layout = 0;
+  if (!getVarint(data, pos, beginBlock) || !getVarint(data, pos, endBlock) || !getVarint(data, pos, nPos)
+      || !getVarint(data, pos, layout)
+      || beginBlock >= endBlock || endBlock > B2 / D + 2 || nPos != jset.size()) {
+    return {};
+  }
+
+  vector<BitBlock> selected(endBlock);
+  const u64 nIndex = (endBlock - beginBlock) * nPos;
+  
+  if (layout == LAYOUT_GAPS) {
+    u64 nSelected = 0;
+    if (!getVarint(data, pos, nSelected)) { return {}; }
+    u64 next = 0;
+    for (u64 i = 0; i < nSelected; ++i) {
+      u64 gap = 0;
+      if (!getVarint(data, pos, gap) || gap >= nIndex - next) { return {}; }
+      u64 index = next + gap;
+      selected[beginBlock + index / nPos][index % nPos] = true;
+      next = index + 1;
+    }
+  } else if (layout == LAYOUT_BITMAP) {
+    if (data.size() - pos != (nIndex + 7) / 8) { return {}; }
+    for (u64 index = 0; index < nIndex; ++index) {
+      if ((data[pos + index / 8] >> (index % 8)) & 1) { selected[beginBlock + index / nPos][index % nPos] = true; }
+    }
+    pos = data.size();
+  } else {
+    return {};
+  }
+  
+  if (pos != data.size()) { return {}; }
+  return {{u32(beginBlock), std::move(selected)}};
+}
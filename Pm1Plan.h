@@ -3,9 +3,12 @@
 #pragma once
 
 #include "common.h"
+#include "Sieve.h"
 
 #include <vector>
 #include <bitset>
+#include <optional>
+#include <string>
 
 class Pm1Plan {
   static constexpr const u32 MAX_BUFS = 1024;
@@ -15,7 +18,7 @@ public:
   
   const u32 nBuf;  // number of precomputed "big" GPU buffers
 
-  vector<bool> primeBits; // Bits indicating primes in [B1,B2].
+  OddBits primeBits; // The primes in (B1, B2].
   
   vector<u32> makeJset();  // A set of nBuf values that are relative prime with "D".
   
@@ -37,21 +40,37 @@ public:
   template<u32 F> u32 reduce(u32 pos) const;
 
   // Returns the prime hit by "a", or 0.
-  u32 hit(const vector<bool>& primes, u32 a);
+  u32 hit(const OddBits& primes, u32 a) const;
 
   template<typename Fun>
-  void scan(const vector<bool>& primes, u32 beginBlock, vector<Pm1Plan::BitBlock>& selected, Fun fun);
+  void scan(const OddBits& primes, u32 beginBlock, vector<Pm1Plan::BitBlock>& selected, Fun fun);
   
 public:
+  // The supported values of D.
+  static constexpr const u32 D_VALUES[] = {210, 330, 420, 462, 660, 770, 924, 1540, 2310};
+  
   static u32 minBufsFor(u32 D);
   static u32 getD(u32 argsD, u32 nBufs) { return argsD ? argsD : (nBufs >= minBufsFor(330) ? 330 : 210); }
 
-  // Simple Erathostene's sieve restricted to the range [B1, B2].
-  // Returns a vector of bits, with the bit corresponding to a prime set.
-  static vector<bool> sieve(u32 bound) { return sieve(1, bound); }
+  struct Chosen {
+    u32 D;
+    pair<u32, vector<BitBlock>> plan; // The makePlan() of D.
+  };
+  
+  // Returns the supported D that fits in nBuf buffers with the fewest MULs, and its plan. The Ds are ranked by
+  // the plans of the bounds scaled down, and only those close to the best are planned in full. The time per MUL,
+  // if known, is only used to log the predicted times: it does not change the choice.
+  static Chosen chooseD(u32 nBuf, u32 B1, u32 B2, float secsPerMul = 0);
+
+  struct Cost {
+    u32 nPair, nSingle, nBlocks;
+    u32 nSetup; // MULs to set up the buffers of jset
+    
+    // The block transition cost is approximated as 2 MULs.
+    u64 muls() const { return u64(nPair) + nSingle + 2 * u64(nBlocks) + nSetup; }
+  };
   
-  // Only the bits between B1 and B2 are set where there is a prime.
-  static vector<bool> sieve(u32 B1, u32 B2);
+  Cost cost{}; // Of the last makePlan().
 
   const u32 D;
   const u32 B1;
@@ -60,10 +79,20 @@ public:
 
   
   Pm1Plan(u32 D, u32 nBuf, u32 B1, u32 B2);
-  Pm1Plan(u32 D, u32 nBuf, u32 B1, u32 B2, vector<bool>&& primeBits);
+  Pm1Plan(u32 D, u32 nBuf, u32 B1, u32 B2, OddBits&& primeBits);
 
   // Returns a sequence of BitBlocks, one entry per block starting with block=0.
   // Each BitBlock has a bit set if the corresponding buffer is selected for multiplication.
   // Also return beginBlock.
   pair<u32, vector<BitBlock>> makePlan();
+
+  // Bump when makePlan() changes, to invalidate the saved plans.
+  static constexpr const u32 PLAN_VERSION = 1;
+
+  // A compact serialization of a plan: the selected positions, numbered block by block from beginBlock,
+  // stored as the varint-encoded gaps between them.
+  string encode(u32 beginBlock, const vector<BitBlock>& selected) const;
+
+  // Returns nullopt if the data is not a plan with this plan's number of buffers.
+  std::optional<pair<u32, vector<BitBlock>>> decode(const string& data) const;
 };
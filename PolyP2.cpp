@@ -0,0 +1,279 @@
+// Copyright Mihai Preda.
+
+#include "PolyP2.h"
+#include "log.h"
+#include "timeutil.h"
+
+#include <gmpxx.h>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+
+namespace {
+
+using Poly = vector<mpz_class>; // The coefficients, lowest degree first.
+
+// The host memory the engine may use for its polynomials.
+constexpr const u64 MAX_BYTES = u64(2) << 30;
+
+// The cost of a point in multiplies modulo 2^E - 1, per level of the tree (measured).
+constexpr const float MULS_PER_LEVEL = 24;
+
+// Packs the coefficients into one integer, each in a slot of "slot" limbs.
+mpz_class pack(const Poly& a, size_t slot) {
+  mpz_class z;
+  mp_limb_t* out = mpz_limbs_write(z.get_mpz_t(), a.size() * slot);
+  memset(out, 0, a.size() * slot * sizeof(mp_limb_t));
+  for (size_t i = 0; i < a.size(); ++i) {
+    size_t n = mpz_size(a[i].get_mpz_t());
+    assert(n <= slot);
+    memcpy(out + i * slot, mpz_limbs_read(a[i].get_mpz_t()), n * sizeof(mp_limb_t));
+  }
+  mpz_limbs_finish(z.get_mpz_t(), a.size() * slot);
+  return z;
+}
+
+// Arithmetic modulo 2^E - 1, and on polynomials with coefficients in [0, 2^E - 1).
+class Ring {
+  const u32 E;
+
+  Poly unpack(const mpz_class& z, size_t n, size_t slot) const {
+    Poly ret(n);
+    size_t size = mpz_size(z.get_mpz_t());
+    const mp_limb_t* in = mpz_limbs_read(z.get_mpz_t());
+    for (size_t i = 0; i < n && i * slot < size; ++i) {
+      size_t len = std::min(slot, size - i * slot);
+      memcpy(mpz_limbs_write(ret[i].get_mpz_t(), len), in + i * slot, len * sizeof(mp_limb_t));
+      mpz_limbs_finish(ret[i].get_mpz_t(), len);
+      reduce(ret[i]);
+    }
+    return ret;
+  }
+
+public:
+  const mpz_class M;
+
+  explicit Ring(u32 E) : E{E}, M{(mpz_class{1} << E) - 1} {}
+
+  // x := x mod M, for x >= 0.
+  void reduce(mpz_class& x) const {
+    while (mpz_sizeinbase(x.get_mpz_t(), 2) > E) {
+      mpz_class high = x >> E;
+      mpz_tdiv_r_2exp(x.get_mpz_t(), x.get_mpz_t(), E);
+      x += high;
+    }
+    if (x == M) { x = 0; }
+  }
+
+  mpz_class mul(const mpz_class& a, const mpz_class& b) const {
+    mpz_class ret = a * b;
+    reduce(ret);
+    return ret;
+  }
+
+  mpz_class sub(const mpz_class& a, const mpz_class& b) const { return a >= b ? mpz_class{a - b} : mpz_class{a + M - b}; }
+
+  mpz_class neg(const mpz_class& a) const { return a == 0 ? a : M - a; }
+
+  mpz_class pow(const mpz_class& x, const mpz_class& e) const {
+    mpz_class ret;
+    mpz_powm(ret.get_mpz_t(), x.get_mpz_t(), e.get_mpz_t(), M.get_mpz_t());
+    return ret;
+  }
+
+  // A coefficient of the product is a sum of at most min(a.size(), b.size()) products of two values below 2^E,
+  // so the coefficients of both polynomials are laid out in slots that fit such a sum, and multiplied as integers.
+  Poly mul(const Poly& a, const Poly& b) const {
+    if (a.empty() || b.empty()) { return {}; }
+    u32 n = std::min(a.size(), b.size());
+    size_t slot = (2 * E + (32 - __builtin_clz(n)) + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS;
+    mpz_class packedA = pack(a, slot);
+    mpz_class c = (&a == &b) ? mpz_class{packedA * packedA} : mpz_class{packedA * pack(b, slot)};
+    return unpack(c, a.size() + b.size() - 1, slot);
+  }
+
+  // a * b mod X^n, with exactly n coefficients.
+  Poly mulLow(const Poly& a, const Poly& b, u32 n) const {
+    Poly ret = mul(Poly(a.begin(), a.begin() + std::min<size_t>(a.size(), n)),
+                   Poly(b.begin(), b.begin() + std::min<size_t>(b.size(), n)));
+    ret.resize(n);
+    return ret;
+  }
+
+  // The inverse of the power series g mod X^n, for g[0] == 1, by Newton iteration.
+  Poly inverse(const Poly& g, u32 n) const {
+    assert(!g.empty() && g[0] == 1);
+    Poly h{1};
+    for (u32 k = 1; k < n;) {
+      u32 k2 = std::min(2 * k, n);
+      // g * h == 1 + X^k * e (mod X^k2), thus h - X^k * h * e is the inverse mod X^k2.
+      Poly gh = mulLow(g, h, k2);
+      Poly he = mulLow(h, Poly(gh.begin() + k, gh.end()), k2 - k);
+      h.resize(k2);
+      for (u32 i = k; i < k2; ++i) { h[i] = neg(he[i - k]); }
+      k = k2;
+    }
+    return h;
+  }
+
+  // a mod g, for a monic g.
+  Poly rem(const Poly& a, const Poly& g) const {
+    assert(g.size() >= 2 && g.back() == 1);
+    u32 d = g.size() - 1;
+    if (a.size() <= d) { return a; }
+
+    // The reversed quotient is rev(a) / rev(g) mod X^m.
+    u32 m = a.size() - d;
+    Poly ra(a.rbegin(), a.rbegin() + m);
+    Poly rq = mulLow(ra, inverse(Poly(g.rbegin(), g.rend()), m), m);
+    Poly qg = mulLow(Poly(rq.rbegin(), rq.rend()), g, d);
+
+    Poly ret(d);
+    for (u32 i = 0; i < d; ++i) { ret[i] = sub(a[i], qg[i]); }
+    return ret;
+  }
+
+  // The product tree of the (X - r) over the roots, from the leaves up: the last level has one node, the product.
+  vector<vector<Poly>> tree(const vector<mpz_class>& roots) const {
+    vector<vector<Poly>> levels(1);
+    for (const mpz_class& r : roots) { levels[0].push_back(Poly{neg(r), 1}); }
+    while (levels.back().size() > 1) {
+      const vector<Poly>& low = levels.back();
+      vector<Poly> up;
+      for (u32 i = 0; i + 1 < low.size(); i += 2) { up.push_back(mul(low[i], low[i + 1])); }
+      if (low.size() % 2) { up.push_back(low.back()); }
+      levels.push_back(std::move(up));
+    }
+    return levels;
+  }
+
+  // The product of f(r) over the roots of the tree, by going down the tree with the remainders of f.
+  mpz_class productOfValues(const Poly& f, const vector<vector<Poly>>& tree) const {
+    vector<Poly> rems{rem(f, tree.back()[0])};
+    for (int level = int(tree.size()) - 2; level >= 0; --level) {
+      vector<Poly> next;
+      for (u32 i = 0; i < tree[level].size(); ++i) { next.push_back(rem(rems[i / 2], tree[level][i])); }
+      rems = std::move(next);
+    }
+
+    mpz_class ret{1};
+    for (const Poly& r : rems) { ret = mul(ret, r.empty() ? mpz_class{} : r[0]); }
+    return ret;
+  }
+};
+
+u32 eulerPhi(u32 n) {
+  u32 ret = n;
+  for (u32 p = 2; p * p <= n; ++p) {
+    if (n % p == 0) {
+      while (n % p == 0) { n /= p; }
+      ret -= ret / p;
+    }
+  }
+  if (n > 1) { ret -= ret / n; }
+  return ret;
+}
+
+// A batch evaluates f of degree n at n points, holding about (log2(n) + 8) * n values of E bits: the tree and
+// the remainders, and the double-size slots of the products. A larger D covers more of B2 per batch at
+// a slowly increasing cost per point, so the largest D that fits the memory and the range is chosen.
+// Returns 0 if not even the smallest D fits.
+u32 chooseD(u32 E, u32 B1, u32 B2) {
+  u32 best = 0;
+  for (u32 D : {210, 2310, 30030, 510510}) {
+    u32 n = eulerPhi(D) / 2;
+    double bytes = (log2(n) + 8) * n * (E / 8.0);
+    if (bytes > MAX_BYTES || (best && n > (B2 - B1) / D)) { break; }
+    best = D;
+  }
+  return best;
+}
+
+mpz_class mpz(const Words& words) {
+  mpz_class b{};
+  mpz_import(b.get_mpz_t(), words.size(), -1 /*order: LSWord first*/, sizeof(u32), 0 /*endianess: native*/, 0 /*nails*/, words.data());
+  return b;
+}
+
+}
+
+double polyP2Secs(u32 E, u32 B1, u32 B2) {
+  assert(B1 < B2);
+  const u32 D = chooseD(E, B1, B2);
+  if (!D) {
+    log("poly P2: E=%u is too large, the polynomials do not fit in %.1f GB\n", E, MAX_BYTES / float(1 << 30));
+    throw "poly P2 out of memory";
+  }
+
+  // A batch of n points costs about MULS_PER_LEVEL multiplies per point per level of the tree, on the scale
+  // of the multiplies modulo 2^E - 1, which are timed.
+  Ring ring{E};
+  mpz_class a = ring.M - 3;
+  Timer timer;
+  u32 nMuls = 0;
+  for (; nMuls < 4 || timer.elapsedSecs() < 0.1; ++nMuls) { a = ring.mul(a, a); }
+  double secsPerMul = timer.elapsedSecs() / nMuls;
+
+  u32 n = eulerPhi(D) / 2;
+  u32 nPoints = B2 / D - B1 / D + 2;
+  double secs = nPoints * (MULS_PER_LEVEL * log2(n) + 2) * secsPerMul;
+  log("poly P2: D=%u, %u points, predicted %.0fs\n", D, nPoints, secs);
+  return secs;
+}
+
+std::string polyP2(u32 E, const Words& p1Data, u32 B1, u32 B2) {
+  assert(B1 < B2);
+  Ring ring{E};
+  mpz_class x = mpz(p1Data);
+  ring.reduce(x);
+
+  const u32 D = chooseD(E, B1, B2);
+  assert(D);
+  Timer timer;
+
+  vector<mpz_class> roots;
+  for (u32 j = 1; j < D / 2; j += 2) {
+    if (std::gcd(j, D) == 1) { roots.push_back(ring.pow(x, mpz_class{j} * j)); }
+  }
+  const Poly f = ring.tree(roots).back()[0];
+  const u32 n = roots.size();
+
+  // The blocks b in [beginBlock, endBlock] cover (B1, B2] with b*D - j and b*D + j.
+  const u32 beginBlock = B1 / D;
+  const u32 endBlock = B2 / D + 1;
+  const u32 nPoints = endBlock - beginBlock + 1;
+  log("D=%u, degree %u, %u points; set up in %.1fs\n", D, n, nPoints, timer.deltaSecs());
+
+  // The points x^((b*D)^2) are stepped by x^((2*b + 1) * D^2), which is in turn stepped by x^(2 * D^2).
+  mpz_class bD = mpz_class{beginBlock} * D;
+  mpz_class point = ring.pow(x, bD * bD);
+  mpz_class delta = ring.pow(x, mpz_class{2 * beginBlock + 1} * D * D);
+  const mpz_class delta2 = ring.pow(x, mpz_class{2} * D * D);
+
+  mpz_class acc{1};
+  Timer sinceLog;
+  for (u32 done = 0; done < nPoints;) {
+    vector<mpz_class> points;
+    for (; points.size() < n && done < nPoints; ++done) {
+      points.push_back(point);
+      point = ring.mul(point, delta);
+      delta = ring.mul(delta, delta2);
+    }
+    acc = ring.mul(acc, ring.productOfValues(f, ring.tree(points)));
+
+    if (done == nPoints || sinceLog.elapsedSecs() >= 60) {
+      sinceLog.reset();
+      double secs = timer.elapsedSecs();
+      log("%5.1f%% %u points, %.0f us/point, ETA %.0fs\n",
+          done * 100.0f / nPoints, done, secs / done * 1e6, secs / done * (nPoints - done));
+    }
+  }
+
+  if (acc == 0) {
+    log("poly P2 error: ZERO\n");
+    throw "poly P2 ZERO";
+  }
+  mpz_class factor = gcd(ring.M, acc);
+  return factor == 1 ? ""s : factor.get_str();
+}
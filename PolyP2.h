@@ -0,0 +1,20 @@
+// Copyright Mihai Preda.
+
+#pragma once
+
+#include "common.h"
+
+#include <string>
+
+// P-1 stage 2 by polynomial multipoint evaluation ("FFT continuation"), on the host. Its cost grows steeply
+// with the exponent, so it is not a production stage 2: it validates prime-pairing on small exponents, see poly.cpp.
+// With x the stage-1 residue, f(X) = prod (X - x^(j^2)) over the odd j < D/2 relatively prime to D
+// is evaluated at the points x^((b*D)^2) of all the blocks b covering (B1, B2]. The product of the values
+// has the factor x^((b*D - j)(b*D + j)) - 1 for every b and j, thus covers every prime in (B1, B2].
+// The polynomial products are single big-integer multiplies (Kronecker substitution), so the cost grows
+// with (B2 - B1) / D * log(D) instead of with the number of primes.
+// Returns GCD(product, 2^E - 1) as a decimal string if not 1, or the empty string.
+std::string polyP2(u32 E, const Words& p1Data, u32 B1, u32 B2);
+
+// The predicted duration of polyP2() in seconds. Throws if it does not fit the host memory for E.
+double polyP2Secs(u32 E, u32 B1, u32 B2);
@@ -5,6 +5,7 @@
 #include "Sha3Hash.h"
 #include "MD5.h"
 #include "Gpu.h"
+#include "timeutil.h"
 
 #include <vector>
 #include <string>
@@ -12,6 +13,8 @@
 #include <filesystem>
 #include <cinttypes>
 #include <climits>
+#include <deque>
+#include <future>
 
 #if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
 #error Byte order must be Little Endian
@@ -46,7 +49,7 @@ ProofInfo getInfo(const fs::path& proofFile) {
     log("Proof file '%s' has invalid header\n", proofFile.string().c_str());
     throw "Invalid proof header";
   }
-  return {power, E, hash};
+  return {power, E, hash, u64(fs::file_size(proofFile))};
 }
 
 }
@@ -59,12 +62,24 @@ fs::path Proof::file(const fs::path& proofDir) const {
   return proofDir / (strE + '-' + to_string(power) + ".proof");  
 }
 
-void Proof::save(const fs::path& proofFile) const {
+ProofInfo Proof::save(const fs::path& proofFile) const {
   File fo = File::openWrite(proofFile);
+  MD5 h;
+  u64 size = 0;
+  auto put = [&](const void* data, u32 nBytes) {
+    fo.write(data, nBytes);
+    h.update(data, nBytes);
+    size += nBytes;
+  };
+  
   u32 power = middles.size();
-  fo.printf(HEADER_v2, power, E, '\n');
-  fo.write(B.data(), (E-1)/8+1);
-  for (const Words& w : middles) { fo.write(w.data(), (E-1)/8+1); }
+  char header[256];
+  int headerSize = snprintf(header, sizeof(header), HEADER_v2, power, E, '\n');
+  assert(headerSize > 0 && headerSize < int(sizeof(header)));
+  put(header, headerSize);
+  put(B.data(), (E-1)/8+1);
+  for (const Words& w : middles) { put(w.data(), (E-1)/8+1); }
+  return {power, E, std::move(h).finish(), size};
 }
 
 Proof Proof::load(const fs::path& path) {
@@ -95,6 +110,7 @@ bool Proof::verify(Gpu *gpu) const {
 
   Words A{makeWords(E, 3)};
   Words B{this->B};
+  Gpu::PowerScope powerScope{gpu};
   
   auto hash = proof::hashWords(E, B);
 
@@ -128,8 +144,8 @@ bool Proof::verify(Gpu *gpu) const {
 
 // ---- ProofSet ----
 
-ProofSet::ProofSet(const fs::path& tmpDir, u32 E, u32 power)
-  : E{E}, power{power}, exponentDir(tmpDir / to_string(E)) {
+ProofSet::ProofSet(const fs::path& tmpDir, u32 E, u32 power, u64 cacheBudget)
+  : E{E}, power{power}, exponentDir(tmpDir / to_string(E)), cache{E, proofPath, cacheBudget, 1u << power} {
   
   assert(E & 1); // E is supposed to be prime
   assert(power > 0);
@@ -157,25 +173,37 @@ ProofSet::ProofSet(const fs::path& tmpDir, u32 E, u32 power)
   assert(points.size() == (1u << power));
 }
 
-bool ProofSet::canDo(const fs::path& tmpDir, u32 E, u32 power, u32 currentK) {
+u32 ProofSet::effectivePower(const fs::path& tmpDir, u32 E, u32 power, u32 currentK) {
   assert(power > 0 && power <= 10);
-  return ProofSet{tmpDir, E, power}.isValidTo(currentK);
-}
+  
+  // The points of a lower power are a subset of those of "power", so the residues are validated only once.
+  vector<u32> ks;
+  vector<char> valid;
+  {
+    ProofSet set{tmpDir, E, power};
+    for (u32 k : set.points) {
+      if (k > currentK) { break; }
+      ks.push_back(k);
+    }
+    valid = set.cache.verify(ks);
+  }
 
-u32 ProofSet::effectivePower(const fs::path& tmpDir, u32 E, u32 power, u32 currentK) {
   for (u32 p = power; p > 0; --p) {
-    log("validating proof residues for power %u\n", p);
-    if (canDo(tmpDir, E, p, currentK)) { return p; }      
+    ProofSet set{tmpDir, E, p};
+    bool ok = true;
+    for (u32 k : set.points) {
+      if (k > currentK) { break; }
+      u32 i = lower_bound(ks.begin(), ks.end(), k) - ks.begin();
+      assert(i < ks.size() && ks[i] == k);
+      if (!valid[i]) {
+        ok = false;
+        break;
+      }
+    }
+    if (ok) { return p; }
   }
   assert(false);
-}
-    
-bool ProofSet::isValidTo(u32 limitK) const {
-  for (u32 k : points) {
-    if (k > limitK) { break; }
-    try { load(k); } catch (...) { return false; }
-  }
-  return true;
+  return 0;
 }
 
 u32 ProofSet::next(u32 k) const {
@@ -195,7 +223,7 @@ Words ProofSet::load(u32 k) const {
   return cache.load(k);
 }
 
-Proof ProofSet::computeProof(Gpu *gpu) const {
+Proof ProofSet::computeProof(Gpu *gpu, u64 memBudget) const {
   Words B = load(E);
   Words A = makeWords(E, 3);
 
@@ -205,27 +233,80 @@ Proof ProofSet::computeProof(Gpu *gpu) const {
   auto hash = proof::hashWords(E, B);
 
   vector<Buffer<i32>> bufVect = gpu->makeBufVector(power);
+  Gpu::PowerScope powerScope{gpu};
+
+  // A pipeline of three stages: the residues are read from disk in the background, uploaded without blocking,
+  // and combined on the GPU; the host only waits for the GPU at the end of each level, for the hash.
+  // Every residue is used exactly once, in this order. Half of memBudget is for the residues read ahead,
+  // half for those being uploaded.
+  vector<u32> order;
+  for (u32 p = 0; p < power; ++p) {
+    u32 s = (1u << (power - p - 1));
+    for (u32 i = 0; i < (1u << p); ++i) { order.push_back(points[s * (i * 2 + 1) - 1]); }
+  }
+  const u32 depth = std::max<u64>(1, memBudget / 2 / (B.size() * sizeof(u32)));
 
+  // Where the time goes, to see which stage is the bottleneck.
+  double readSecs = 0, waitReadSecs = 0, enqueueSecs = 0, waitGpuSecs = 0;
+  Timer timer;
+  
+  std::deque<std::future<pair<Words, double>>> ahead;
+  u32 nextLoad = 0;
+  auto loadNext = [&]() {
+    while (nextLoad < order.size() && ahead.size() < depth) {
+      ahead.push_back(std::async(std::launch::async, [this, k = order[nextLoad++]]() {
+        Timer readTimer;
+        Words w = load(k);
+        return pair{std::move(w), readTimer.elapsedSecs()};
+      }));
+    }
+    timer.reset();
+    auto [w, secs] = ahead.front().get();
+    waitReadSecs += timer.elapsedSecs();
+    readSecs += secs;
+    ahead.pop_front();
+    return std::move(w);
+  };
+
+  std::deque<Words> uploading;
+  
   for (u32 p = 0; p < power; ++p) {
     auto bufIt = bufVect.begin();
     assert(p == hashes.size());
-    u32 s = (1u << (power - p - 1));
     for (u32 i = 0; i < (1u << p); ++i) {
-      Words w = load(points[s * (i * 2 + 1) - 1]);
-      gpu->writeIn(*bufIt++, w);
+      Words w = loadNext();
+      if (uploading.size() >= depth) {
+        timer.reset();
+        gpu->finish();
+        waitGpuSecs += timer.elapsedSecs();
+        uploading.clear();
+      }
+
+      timer.reset();
+      gpu->writeInAsync(*bufIt++, w);
+      uploading.push_back(std::move(w));
       for (u32 k = 0; i & (1u << k); ++k) {
         assert(k <= p - 1);
         --bufIt;
         u64 h = hashes[p - 1 - k];
         gpu->expMul(*(bufIt - 1), h, *bufIt);
       }
+      enqueueSecs += timer.elapsedSecs();
     }
     assert(bufIt == bufVect.begin() + 1);
+    timer.reset();
     middles.push_back(gpu->readAndCompress(bufVect.front()));
+    waitGpuSecs += timer.elapsedSecs();
+    uploading.clear();
     hash = proof::hashWords(E, hash, middles.back());
     hashes.push_back(hash[0]);
 
     log("proof level %u : M %016" PRIx64 ", h %016" PRIx64 "\n", p, res64(middles.back()), hashes.back()); 
   }
+
+  double mb = order.size() * B.size() * sizeof(u32) * 1e-6;
+  log("proof stages: read %u residues in %.1fs (%.0f MB/s per reader), waited %.1fs for the reads, "
+      "%.1fs enqueueing, %.1fs for the GPU\n",
+      u32(order.size()), readSecs, readSecs ? mb / readSecs : 0, waitReadSecs, enqueueSecs, waitGpuSecs);
   return Proof{E, std::move(B), std::move(middles)};
 }
@@ -14,6 +14,7 @@ struct ProofInfo {
   u32 power;
   u32 exp;
   string md5;
+  u64 size; // bytes
 };
 
 namespace proof {
@@ -45,7 +46,8 @@ public:
 
   static Proof load(const fs::path& path);
   
-  void save(const fs::path& proofResultDir) const;
+  // Returns the info of the written file, its MD5 computed while writing.
+  ProofInfo save(const fs::path& proofFile) const;
 
   fs::path file(const fs::path& proofDir) const;
   
@@ -60,25 +62,26 @@ public:
 private:  
   fs::path exponentDir;
   fs::path proofPath{exponentDir / "proof"};
-  ProofCache cache{E, proofPath};
+  ProofCache cache;
 
   vector<u32> points;  
   
-  bool isValidTo(u32 limitK) const;
-
-  static bool canDo(const fs::path& tmpDir, u32 E, u32 power, u32 currentK);
-
 public:
   
   static u32 effectivePower(const fs::path& tmpDir, u32 E, u32 power, u32 currentK);
   
-  ProofSet(const fs::path& tmpDir, u32 E, u32 power);
+  // cacheBudget: bytes of residues allowed to wait in memory for the writer, see ProofCache.
+  ProofSet(const fs::path& tmpDir, u32 E, u32 power, u64 cacheBudget = 0);
     
   u32 next(u32 k) const;
 
   void save(u32 k, const Words& words);
 
+  // Waits for the saved residues to be written.
+  void sync() { cache.sync(); }
+
   Words load(u32 k) const;
         
-  Proof computeProof(Gpu *gpu) const;
+  // memBudget: bytes of residues read ahead from disk.
+  Proof computeProof(Gpu *gpu, u64 memBudget) const;
 };
@@ -2,21 +2,25 @@
 
 #include "ProofCache.h"
 #include "File.h"
+#include "parallel.h"
+
+#include <atomic>
+#include <cinttypes>
+#include <map>
 
 bool ProofCache::write(u32 k, const Words& words) {
   try {
-    File f = File::openWrite(proofPath / to_string(k));
-    f.write(words);
-    f.write<u32>({crc32(words)});
+    // Read back, to catch bad writes before the residue is dropped from memory.
+    return store.write(k, words) && words == read(k);
   } catch (fs::filesystem_error& e) {
     return false;
   }
-
-  assert(words == read(k));
-  return true;
 }
 
 Words ProofCache::read(u32 k) const {
+  if (auto words = store.read(k)) { return *words; }
+  
+  // The older format, one file per residue.
   File f = File::openReadThrow(proofPath / to_string(k));
   vector<u32> words = f.read<u32>(E / 32 + 2);
   u32 checksum = words.back();
@@ -28,10 +32,145 @@ Words ProofCache::read(u32 k) const {
   return words;
 }
 
+void ProofCache::writerLoop() {
+  std::unique_lock lock{mut};
+  u32 seenSaves = 0;
+  while (true) {
+    cond.wait(lock, [&]{ return stop || (!pending.empty() && (!failing || nSaves != seenSaves)); });
+    if (pending.empty()) { return; }
+
+    seenSaves = nSaves;
+    failing = false;
+    // Write in order; the entries stay in "pending" so that load() finds them meanwhile.
+    for (auto it = pending.begin(); it != pending.end();) {
+      auto [k, words] = *it;
+      lock.unlock();
+      bool ok = write(k, words);
+      lock.lock();
+      if (!ok) {
+        failing = true;
+        break;
+      }
+      if (it->second == words) {
+        pendingBytes -= words.size() * sizeof(u32);
+        it = pending.erase(it);
+        cond.notify_all();
+      } else {
+        ++it; // saved again meanwhile, will be written on the next pass
+      }
+    }
+    if (failing) {
+      log("Could not write %u residues under '%s' -- hurry make space!\n", u32(pending.size()), proofPath.string().c_str());
+      if (stop) { return; }
+    }
+    cond.notify_all();
+  }
+}
+
+ProofCache::~ProofCache() {
+  {
+    std::lock_guard lock{mut};
+    stop = true;
+  }
+  cond.notify_all();
+  if (writer.joinable()) { writer.join(); }
+}
+
+void ProofCache::save(u32 k, const Words& words) {
+  u64 bytes = words.size() * sizeof(u32);
+  std::unique_lock lock{mut};
+  if (!writer.joinable()) { writer = std::thread{&ProofCache::writerLoop, this}; }
+  cond.wait(lock, [&]{ return failing || pending.empty() || pendingBytes + bytes <= budget; });
+  auto [it, isNew] = pending.insert_or_assign(k, words);
+  if (isNew) { pendingBytes += bytes; }
+  ++nSaves;
+  cond.notify_all();
+}
+
+Words ProofCache::load(u32 k) const {
+  {
+    std::lock_guard lock{mut};
+    auto it = pending.find(k);
+    if (it != pending.end()) { return it->second; }
+  }
+  return read(k);
+}
+
+bool ProofCache::contains(u32 k) const {
+  {
+    std::lock_guard lock{mut};
+    if (pending.count(k)) { return true; }
+  }
+  error_code noThrow;
+  return store.contains(k) || fs::exists(proofPath / to_string(k), noThrow);
+}
+
+std::optional<ProofCache::Stamp> ProofCache::stamp(u32 k) const {
+  if (auto crc = store.crcOf(k)) { return Stamp{((E - 1) / 32 + 1) * sizeof(u32), 0, *crc}; }
 
-void ProofCache::flush() {
-  for (auto it = pending.cbegin(), end = pending.cend(); it != end && write(it->first, it->second); it = pending.erase(it));
-  if (!pending.empty()) {
-    log("Could not write %u residues under '%s' -- hurry make space!\n", u32(pending.size()), proofPath.string().c_str());
+  error_code noThrow;
+  fs::path file = proofPath / to_string(k);
+  u64 size = fs::file_size(file, noThrow);
+  if (noThrow) { return {}; }
+  auto mtime = fs::last_write_time(file, noThrow);
+  if (noThrow) { return {}; }
+  return Stamp{size, i64(mtime.time_since_epoch().count()), 0};
+}
+
+vector<char> ProofCache::verify(const vector<u32>& ks) {
+  fs::path manifestFile = proofPath / "verified.txt";
+  std::map<u32, Stamp> manifest;
+  if (File fi = File::openRead(manifestFile)) {
+    for (string line; !(line = fi.readLine()).empty();) {
+      u32 k = 0, crc = 0;
+      u64 size = 0;
+      i64 mtime = 0;
+      if (sscanf(line.c_str(), "%u %" SCNu64 " %" SCNd64 " %x", &k, &size, &mtime, &crc) == 4) { manifest[k] = {size, mtime, crc}; }
+    }
   }
+
+  vector<char> valid(ks.size());
+  vector<std::optional<Stamp>> stamps(ks.size());
+  std::atomic<u32> nRead = 0;
+  parallelFor(ks.size(), [&](u32 begin, u32 end) {
+    for (u32 i = begin; i < end; ++i) {
+      u32 k = ks[i];
+      stamps[i] = stamp(k);
+      if (!stamps[i]) { continue; }
+      auto it = manifest.find(k);
+      if (it != manifest.end() && it->second == *stamps[i]) {
+        valid[i] = true;
+      } else {
+        ++nRead;
+        try {
+          read(k);
+          valid[i] = true;
+        } catch (...) {}
+      }
+    }
+  }, 1);
+
+  try {
+    fs::path tmp = manifestFile;
+    tmp += ".tmp";
+    {
+      File fo = File::openWrite(tmp);
+      for (u32 i = 0; i < ks.size(); ++i) {
+        if (!valid[i]) { continue; }
+        const Stamp& s = *stamps[i];
+        fo.printf("%u %" PRIu64 " %" PRId64 " %x\n", ks[i], s.size, s.mtime, s.crc);
+      }
+    }
+    fs::rename(tmp, manifestFile);
+  } catch (const fs::filesystem_error& e) {
+    log("Could not write '%s' : %s\n", manifestFile.string().c_str(), e.what());
+  }
+
+  log("validated %u proof residues, %u read\n", u32(ks.size()), nRead.load());
+  return valid;
+}
+
+void ProofCache::sync() {
+  std::unique_lock lock{mut};
+  cond.wait(lock, [&]{ return pending.empty() || failing; });
 }
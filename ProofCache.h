@@ -3,38 +3,67 @@
 #pragma once
 
 #include "common.h"
+#include "ResidueStore.h"
 
-#include <unordered_map>
+#include <condition_variable>
 #include <filesystem>
+#include <map>
+#include <mutex>
+#include <thread>
 
 namespace fs = std::filesystem;
 
+// The proof residues, saved to the ResidueStore by a background writer thread. save() only blocks when the residues
+// not yet written exceed the memory budget. When writing fails (e.g. the disk is full) the residues are kept in memory
+// and retried on the next save(). Residues in the older one-file-per-k format are still read.
 class ProofCache {
   const u32 E;
-  std::unordered_map<u32, Words> pending;
   fs::path proofPath;
+  const u64 budget; // bytes
+  ResidueStore store;
+
+  mutable std::mutex mut;
+  std::condition_variable cond;
+  std::map<u32, Words> pending; // not yet written; includes the residue being written
+  u64 pendingBytes = 0;
+  u32 nSaves = 0;       // bumped on every save(), to retry after a failed write
+  bool failing = false; // the last write failed; save() doesn't block on the budget then
+  bool stop = false;
+  std::thread writer; // started on the first save()
   
   bool write(u32 k, const Words& words);
 
   Words read(u32 k) const;
 
-  void flush();
+  void writerLoop();
+
+  // What identifies a residue on disk for the validation manifest.
+  struct Stamp {
+    u64 size;
+    i64 mtime; // for the residues in their own file
+    u32 crc;   // from the ResidueStore index
+    bool operator==(const Stamp& rhs) const { return size == rhs.size && mtime == rhs.mtime && crc == rhs.crc; }
+  };
+
+  std::optional<Stamp> stamp(u32 k) const;
   
 public:
-  ProofCache(u32 E, const fs::path& proofPath) : E{E}, proofPath{proofPath} {}
+  ProofCache(u32 E, const fs::path& proofPath, u64 budget, u32 nSlots)
+    : E{E}, proofPath{proofPath}, budget{budget}, store{proofPath / "residues", E, nSlots} {}
   
-  ~ProofCache() { flush(); }
+  ~ProofCache();
   
-  void save(u32 k, const Words& words) {
-    if (pending.empty() && write(k, words)) { return; }    
-    pending[k] = words;
-    flush();
-  }
-
-  Words load(u32 k) const {
-    auto it = pending.find(k);
-    return (it == pending.end()) ? read(k) : it->second;
-  }
-
-  void clear() { pending.clear(); }
+  void save(u32 k, const Words& words);
+
+  Words load(u32 k) const;
+
+  // Whether k was saved, without reading or checking the residue.
+  bool contains(u32 k) const;
+
+  // Checks, in parallel, that the residues ks can be read and match their CRC. The residues that were validated
+  // before and didn't change since (same size, mtime and CRC in the manifest) are not read again.
+  vector<char> verify(const vector<u32>& ks);
+
+  // Waits until the residues saved so far are written, or have failed to write.
+  void sync();
 };
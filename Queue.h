@@ -3,6 +3,7 @@
 #pragma once
 
 #include "Buffer.h"
+#include "Trace.h"
 
 #include <algorithm>
 #include <map>
@@ -27,36 +28,67 @@ class Event : public EventHolder {
 public:
   double secs() { return getEventNanos(this->get()) * 1e-9f; }
   bool isComplete() { return getEventInfo(this->get()) == CL_COMPLETE; }
+  EventTimes times() { return getEventTimes(this->get()); }
 };
 
 using QueuePtr = std::shared_ptr<class Queue>;
 
 class Queue : public QueueHolder {
-  using TimeMap = std::map<std::string, TimeInfo>;
-  TimeMap timeMap;
-  std::vector<std::pair<Event, TimeMap::iterator>> events;
+  // Per-kernel stats, indexed by the id returned from registerKernel().
+  std::vector<std::string> names;
+  std::vector<TimeInfo> stats;
+  
+  struct Launch {
+    Event event;
+    u32 kernelId;
+    bool timed;  // added to the per-kernel stats
+    u64 hostNs;  // enqueue time on the Trace clock, when tracing
+  };
+  std::vector<Launch> events;
+  Event lastEvent; // the most recent launch, when it is not among the recorded events (-yield)
   bool profile{};
+  bool sampling{};
   bool cudaYield{};
 
 public:
   Queue(cl_queue q, bool profile, bool cudaYield) : QueueHolder{q}, profile{profile}, cudaYield{cudaYield} {}  
-  static QueuePtr make(const Context& context, bool profile, bool cudaYield) { return make_shared<Queue>(makeQueue(context.deviceId(), context.get(), profile), profile, cudaYield); }
+
+  // With "canSample" the queue is created with profiling enabled, but the launches are only timed between
+  // setSampling(true) and setSampling(false). Profiling is also enabled when tracing.
+  static QueuePtr make(const Context& context, bool profile, bool cudaYield, bool canSample = false) {
+    bool enableProfiling = profile || canSample || Trace::enabled();
+    return make_shared<Queue>(makeQueue(context.deviceId(), context.get(), enableProfiling), profile, cudaYield);
+  }
+
+  void setSampling(bool on) { sampling = on; }
+
+  // Called once per Kernel, so that run() doesn't need to look up the name.
+  u32 registerKernel(const std::string& name) {
+    auto it = std::find(names.begin(), names.end(), name);
+    if (it != names.end()) { return it - names.begin(); }
+    names.push_back(name);
+    stats.emplace_back();
+    return names.size() - 1;
+  }
   
-  void run(cl_kernel kernel, size_t groupSize, size_t workSize, const string &name) {
-    Event event{::run(get(), kernel, groupSize, workSize, name, profile || cudaYield)};
-    auto it = profile ? timeMap.insert({name, TimeInfo{}}).first : timeMap.end();
-    if (profile) {
-      events.emplace_back(std::move(event), it);
+  void run(cl_kernel kernel, size_t groupSize, size_t workSize, u32 kernelId) {
+    bool timed = profile || sampling;
+    bool traced = Trace::enabled();
+    u64 hostNs = traced ? Trace::nowNs() : 0;
+    bool record = timed || traced;
+    Event event{::run(get(), kernel, groupSize, workSize, names[kernelId], record || cudaYield)};
+    if (record) {
+      events.push_back({std::move(event), kernelId, timed, hostNs});
+      lastEvent.reset();
     } else if (cudaYield) {
-      if (events.empty()) {
-        events.emplace_back(std::move(event), it);
-      } else {
-        events.front() = std::make_pair(std::move(event), it);
-      }
+      lastEvent = std::move(event);
     }
   }
 
-  bool allEventsCompleted() { return events.empty() || events.back().first.isComplete(); }
+  bool allEventsCompleted() {
+    if (lastEvent) { return lastEvent.isComplete(); }
+    return events.empty() || events.back().event.isComplete();
+  }
 
   void flush() { ::flush(get()); }
   
@@ -74,21 +106,32 @@ public:
     
     ::finish(get());
     
-    if (profile) { for (auto& [event, it] : events) { it->second.add(event.secs()); } }
+    for (Launch& launch : events) {
+      if (launch.timed) { stats[launch.kernelId].add(launch.event.secs()); }
+      if (launch.hostNs) {
+        // Moves the device timestamps onto the host clock, aligned at the enqueue.
+        EventTimes t = launch.event.times();
+        Trace::addKernel(names[launch.kernelId], launch.hostNs + (t.start - t.queued), launch.hostNs + (t.end - t.queued));
+      }
+    }
     events.clear();
+    lastEvent.reset();
   }
 
   using Profile = std::vector<std::pair<TimeInfo, std::string>>;
   Profile getProfile() {
     Profile p;
-    for (auto& [name, info] : timeMap) { p.emplace_back(info, name); }
+    for (u32 id = 0; id < names.size(); ++id) {
+      if (stats[id].n) { p.emplace_back(stats[id], names[id]); }
+    }
     std::sort(p.begin(), p.end());
     return p;
   }
 
   void clearProfile() {
     events.clear();
-    timeMap.clear();
+    lastEvent.reset();
+    for (TimeInfo& info : stats) { info.clear(); }
   }
 
   /*
@@ -0,0 +1,157 @@
+// Copyright (C) Mihai Preda.
+
+#include "ResidueStore.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr u32 MAGIC = 0x53455250; // "PRES"
+constexpr u32 VERSION = 1;
+constexpr u32 HEADER_WORDS = 4; // magic, version, E, nSlots
+constexpr u64 ALIGN = 4096;
+
+constexpr u64 alignUp(u64 x) { return (x + ALIGN - 1) / ALIGN * ALIGN; }
+
+constexpr u64 dataStart() { return alignUp(HEADER_WORDS * sizeof(u32) + ResidueStore::MAX_SLOTS * 2 * sizeof(u32)); }
+
+bool preadAll(int fd, void* data, u64 size, u64 offset) {
+  return pread(fd, data, size, offset) == ssize_t(size);
+}
+
+bool pwriteAll(int fd, const void* data, u64 size, u64 offset) {
+  return pwrite(fd, data, size, offset) == ssize_t(size);
+}
+
+}
+
+ResidueStore::ResidueStore(const fs::path& file, u32 E, u32 nSlots)
+  : file{file}, E{E}, nWords{(E - 1) / 32 + 1}, nSlots{std::min(nSlots, MAX_SLOTS)}, index(MAX_SLOTS) {
+  fd = open(file.string().c_str(), O_RDWR);
+  if (fd < 0) { return; }
+
+  u32 header[HEADER_WORDS];
+  if (!preadAll(fd, header, sizeof(header), 0) || header[0] != MAGIC || header[1] != VERSION || header[2] != E
+      || !preadAll(fd, index.data(), MAX_SLOTS * sizeof(Entry), sizeof(header))) {
+    log("Ignoring invalid proof residues file '%s'\n", file.string().c_str());
+    close(fd);
+    fd = -1;
+    index.assign(MAX_SLOTS, Entry{});
+  }
+}
+
+ResidueStore::~ResidueStore() {
+  if (fd >= 0) { close(fd); }
+}
+
+u64 ResidueStore::slotSize() const { return alignUp(nWords * sizeof(u32)); }
+
+u64 ResidueStore::slotOffset(u32 slot) const { return dataStart() + slot * slotSize(); }
+
+bool ResidueStore::create() {
+  int newFd = open(file.string().c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (newFd < 0) { return false; }
+  {
+    std::lock_guard lock{mut};
+    fd = newFd;
+    index.assign(MAX_SLOTS, Entry{});
+  }
+  
+  u32 header[HEADER_WORDS] = {MAGIC, VERSION, E, nSlots};
+  if (!pwriteAll(fd, header, sizeof(header), 0) || !pwriteAll(fd, index.data(), MAX_SLOTS * sizeof(Entry), sizeof(header))) {
+    return false;
+  }
+  
+#if defined(__linux__)
+  // Reserve the space up front; without support for it the file simply grows with the writes.
+  if (fallocate(fd, 0, 0, slotOffset(nSlots)) && errno != EOPNOTSUPP) {
+    log("Can't preallocate '%s' : %s\n", file.string().c_str(), strerror(errno));
+    return false;
+  }
+#endif
+  return fdatasync(fd) == 0;
+}
+
+bool ResidueStore::writeEntry(u32 slot, Entry e) {
+  return pwriteAll(fd, &e, sizeof(e), HEADER_WORDS * sizeof(u32) + slot * sizeof(Entry)) && fdatasync(fd) == 0;
+}
+
+bool ResidueStore::contains(u32 k) const {
+  std::lock_guard lock{mut};
+  for (const Entry& e : index) { if (e.k == k) { return true; } }
+  return false;
+}
+
+std::optional<u32> ResidueStore::crcOf(u32 k) const {
+  std::lock_guard lock{mut};
+  for (const Entry& e : index) { if (e.k == k) { return e.crc; } }
+  return {};
+}
+
+// Only called from the single ProofCache writer thread, which is why "index" is only locked for the updates.
+bool ResidueStore::write(u32 k, const Words& words) {
+  assert(k && words.size() == nWords);
+  if (fd < 0 && !create()) {
+    std::lock_guard lock{mut};
+    if (fd >= 0) {
+      close(fd);
+      fd = -1;
+    }
+    return false;
+  }
+
+  u32 slot = MAX_SLOTS;
+  for (u32 i = 0; i < MAX_SLOTS; ++i) {
+    if (index[i].k == k) {
+      slot = i;
+      break;
+    }
+    if (!index[i].k && slot == MAX_SLOTS) { slot = i; }
+  }
+  if (slot == MAX_SLOTS) {
+    log("No free slot in '%s' for %u\n", file.string().c_str(), k);
+    return false;
+  }
+
+  if (index[slot].k) {
+    // Overwriting: invalidate the entry first, so that a crash midway doesn't leave a bad residue indexed.
+    if (!writeEntry(slot, Entry{})) { return false; }
+    std::lock_guard lock{mut};
+    index[slot] = Entry{};
+  }
+
+  Entry e{k, crc32(words)};
+  if (!pwriteAll(fd, words.data(), nWords * sizeof(u32), slotOffset(slot)) || fdatasync(fd) || !writeEntry(slot, e)) {
+    return false;
+  }
+  std::lock_guard lock{mut};
+  index[slot] = e;
+  return true;
+}
+
+std::optional<Words> ResidueStore::read(u32 k) const {
+  Entry e{};
+  u32 slot = 0;
+  int readFd = -1;
+  {
+    std::lock_guard lock{mut};
+    for (; slot < MAX_SLOTS && index[slot].k != k; ++slot);
+    if (slot == MAX_SLOTS) { return {}; }
+    e = index[slot];
+    readFd = fd;
+  }
+
+  Words words(nWords);
+  if (!preadAll(readFd, words.data(), nWords * sizeof(u32), slotOffset(slot))) {
+    throw fs::filesystem_error{"can't read proof residue", file, std::error_code{errno, std::generic_category()}};
+  }
+  if (crc32(words) != e.crc) {
+    log("checksum %x (expected %x) for %u in '%s'\n", crc32(words), e.crc, k, file.string().c_str());
+    throw fs::filesystem_error{"checksum mismatch", {}};
+  }
+  return words;
+}
@@ -0,0 +1,54 @@
+// Copyright (C) Mihai Preda.
+
+#pragma once
+
+#include "common.h"
+
+#include <filesystem>
+#include <mutex>
+#include <optional>
+
+namespace fs = std::filesystem;
+
+// The proof residues of one exponent in a single file, in fixed-size slots. The header holds, for each slot,
+// the k of the residue in it and the CRC of its words; so knowing which residues are present only needs the header.
+// The file is created (and preallocated for nSlots residues) on the first write.
+class ResidueStore {
+public:
+  static constexpr u32 MAX_SLOTS = 1024; // proof power 10
+
+private:
+  struct Entry {
+    u32 k;
+    u32 crc;
+  };
+  
+  const fs::path file;
+  const u32 E;
+  const u32 nWords;
+  const u32 nSlots;
+  int fd = -1;
+
+  mutable std::mutex mut; // guards index
+  vector<Entry> index;
+
+  u64 slotSize() const;
+  u64 slotOffset(u32 slot) const;
+  bool create();
+  bool writeEntry(u32 slot, Entry e);
+
+public:
+  ResidueStore(const fs::path& file, u32 E, u32 nSlots);
+  ~ResidueStore();
+
+  bool contains(u32 k) const;
+
+  // The CRC recorded in the index for k.
+  std::optional<u32> crcOf(u32 k) const;
+  
+  // Returns false on failure, e.g. no space left on the disk.
+  bool write(u32 k, const Words& words);
+
+  // Returns nullopt if k is not in the store; throws on a CRC mismatch.
+  std::optional<Words> read(u32 k) const;
+};
@@ -4,6 +4,7 @@
 #include "File.h"
 #include "Blake2.h"
 #include "Args.h"
+#include "Trace.h"
 
 #include <filesystem>
 #include <functional>
@@ -175,6 +176,7 @@ PRPState Saver::loadPRPAux(u32 k) {
 }
 
 void Saver::savePRP(const PRPState& state) {
+  TraceSpan span{"Saver::savePRP"};
   assert(state.check.size() == nWords(E));
   u32 k = state.k;
   
@@ -0,0 +1,142 @@
+// Copyright Mihai Preda.
+
+#include "Sieve.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <cmath>
+
+namespace {
+
+// In a segment, byte i stands for the odd number 2*(i0 + i) + 1.
+constexpr u32 SEGMENT = 1u << 16;
+
+constexpr u32 WHEEL_PRIMES[] = {3, 5, 7, 11, 13};
+
+// The period, in odd numbers, of the pattern pre-sieved by the wheel primes.
+constexpr u32 WHEEL = 3 * 5 * 7 * 11 * 13;
+
+// Long enough that a segment can be copied starting at any offset within the period.
+vector<u8> makePattern() {
+  vector<u8> pattern(WHEEL + SEGMENT, 1);
+  for (u32 q : WHEEL_PRIMES) {
+    for (u32 i = q / 2; i < pattern.size(); i += q) { pattern[i] = 0; }
+  }
+  return pattern;
+}
+
+// The odd primes above the wheel up to "limit", used to sieve the segments.
+vector<u32> sievingPrimes(u32 limit) {
+  vector<bool> composite(limit + 1);
+  vector<u32> primes;
+  for (u32 p = 3; p <= limit; p += 2) {
+    if (composite[p]) { continue; }
+    if (p > WHEEL_PRIMES[std::size(WHEEL_PRIMES) - 1]) { primes.push_back(p); }
+    for (u32 i = p * p; i <= limit; i += 2 * p) { composite[i] = true; }
+  }
+  return primes;
+}
+
+u32 isqrt(u32 x) {
+  u64 r = sqrt(double(x));
+  while (r * r > x) { --r; }
+  while ((r + 1) * (r + 1) <= x) { ++r; }
+  return r;
+}
+
+// Sieves the odd numbers with indices [i0, i1) into seg; seg[i - i0] is set iff 2*i + 1 is prime.
+void sieveSegment(u32 i0, u32 i1, const vector<u8>& pattern, const vector<u32>& primes, u8* seg) {
+  assert(i1 - i0 <= SEGMENT);
+  memcpy(seg, pattern.data() + i0 % WHEEL, i1 - i0);
+
+  for (u32 p : primes) {
+    u64 iSquare = (u64(p) * p) / 2;  // the index of p^2, the first multiple not already sieved by a smaller prime
+    if (iSquare >= i1) { break; }
+    u64 i = iSquare >= i0 ? iSquare : i0 + (p / 2 + p - i0 % p) % p;  // first index of an odd multiple of p
+    for (; i < i1; i += p) { seg[i - i0] = 0; }
+  }
+
+  if (i0 == 0) { seg[0] = 0; }  // 1 is not prime
+  for (u32 q : WHEEL_PRIMES) {
+    if (i0 <= q / 2 && q / 2 < i1) { seg[q / 2 - i0] = 1; }  // the pattern cleared the wheel primes themselves
+  }
+}
+
+// Sieves the odd numbers in [from, to] and calls f(segmentIndex, i0, i1, seg) for each segment, from multiple threads.
+// The segments are aligned to multiples of SEGMENT, so that they map to disjoint words of a bitmap indexed by value.
+template<typename F>
+u32 forSegments(u32 from, u32 to, F f) {
+  if (to < 3 || from > to) { return 0; }
+  u32 iBegin = from / 2;
+  u32 iEnd = (to - 1) / 2 + 1;
+  if (iBegin >= iEnd) { return 0; }
+
+  u32 first = iBegin / SEGMENT;
+  u32 nSegments = (iEnd - 1) / SEGMENT - first + 1;
+  
+  static const vector<u8> pattern = makePattern();
+  vector<u32> primes = sievingPrimes(isqrt(to));
+  
+  parallelFor(nSegments, [&](u32 begin, u32 end) {
+    vector<u8> seg(SEGMENT);
+    for (u32 k = begin; k < end; ++k) {
+      u32 i0 = std::max(iBegin, (first + k) * SEGMENT);
+      u32 i1 = u32(std::min(u64(iEnd), u64(first + k + 1) * SEGMENT));
+      sieveSegment(i0, i1, pattern, primes, seg.data());
+      f(k, i0, i1, seg.data());
+    }
+  }, 4);
+  return nSegments;
+}
+
+}
+
+OddBits::OddBits(u32 from, u32 to) {
+  if (to >= 1 && from <= to) {
+    first = (from / 2) & ~63u;
+    nBits = (to - 1) / 2 + 1 - first;
+    words.resize((u64(nBits) + 63) / 64);
+  }
+}
+
+u64 OddBits::count() const {
+  u64 n = 0;
+  for (u64 w : words) { n += __builtin_popcountll(w); }
+  return n;
+}
+
+namespace sieve {
+
+vector<u32> primes(u32 from, u32 to) {
+  vector<vector<u32>> parts(to >= 3 && from <= to ? (to - 1) / 2 / SEGMENT - from / 2 / SEGMENT + 1 : 0);
+  forSegments(from, to, [&parts](u32 k, u32 i0, u32 i1, const u8* seg) {
+    vector<u32>& part = parts[k];
+    for (u32 i = i0; i < i1; ++i) { if (seg[i - i0]) { part.push_back(2 * i + 1); } }
+  });
+
+  vector<u32> ret;
+  if (from <= 2 && 2 <= to) { ret.push_back(2); }
+  for (const auto& part : parts) { ret.insert(ret.end(), part.begin(), part.end()); }
+  return ret;
+}
+
+vector<bool> bits(u32 from, u32 to) {
+  vector<bool> ret(u64(to) + 1);
+  if (from <= 2 && 2 <= to) { ret[2] = true; }
+  forSegments(from, to, [&ret](u32, u32 i0, u32 i1, const u8* seg) {
+    for (u32 i = i0; i < i1; ++i) { if (seg[i - i0]) { ret[2 * i + 1] = true; } }
+  });
+  return ret;
+}
+
+OddBits oddBits(u32 from, u32 to) {
+  OddBits ret{from, to};
+  forSegments(from, to, [&ret](u32, u32 i0, u32 i1, const u8* seg) {
+    for (u32 i = i0; i < i1; ++i) { if (seg[i - i0]) { ret.set(2 * i + 1); } }
+  });
+  return ret;
+}
+
+}
@@ -0,0 +1,52 @@
+// Copyright Mihai Preda.
+
+#pragma once
+
+#include "common.h"
+
+#include <cassert>
+#include <vector>
+
+// A set of odd numbers stored as a bitmap: bit i stands for 2 * (first + i) + 1.
+// Even numbers and numbers outside the covered range are never in the set.
+class OddBits {
+  u32 first{}; // a multiple of 64, so that the words of disjoint 64-aligned ranges can be written concurrently
+  u32 nBits{};
+  vector<u64> words;
+
+  u32 index(u32 n) const {
+    assert((n & 1) && n / 2 >= first && n / 2 - first < nBits);
+    return n / 2 - first;
+  }
+
+public:
+  OddBits() = default;
+
+  // Empty, covering the odd numbers in [from, to].
+  OddBits(u32 from, u32 to);
+
+  bool operator[](u32 n) const {
+    u32 i = n / 2 - first; // wraps around to above nBits when n / 2 < first
+    return i < nBits && (n & 1) && ((words[i / 64] >> (i % 64)) & 1);
+  }
+
+  void set(u32 n)   { u32 i = index(n); words[i / 64] |=  (u64(1) << (i % 64)); }
+  void clear(u32 n) { u32 i = index(n); words[i / 64] &= ~(u64(1) << (i % 64)); }
+
+  u64 count() const;
+};
+
+// Segmented sieve of Eratosthenes over the odd numbers. Every segment is sized to stay in cache and starts as a copy
+// of a pattern pre-sieved by the small primes (the wheel); the segments are sieved in parallel.
+namespace sieve {
+
+// The primes in [from, to], in increasing order.
+vector<u32> primes(u32 from, u32 to);
+
+// A bitmap of (to + 1) bits indexed by value, with exactly the bits of the primes in [from, to] set.
+vector<bool> bits(u32 from, u32 to);
+
+// The odd primes in [from, to], stored in (to - from) / 2 bits instead of the (to + 1) bits of bits().
+OddBits oddBits(u32 from, u32 to);
+
+}
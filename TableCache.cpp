@@ -0,0 +1,99 @@
+// Copyright Mihai Preda.
+
+#include "TableCache.h"
+#include "File.h"
+
+#include <algorithm>
+
+namespace {
+
+error_code& noThrow() {
+  static error_code dummy;
+  return dummy;
+}
+
+}
+
+// Format: u32 nParts, then for each part u64 size followed by the bytes; at the end u32 crc32 of all the above.
+std::optional<vector<string>> TableCache::load(const string& name, u32 nParts) {
+  fs::path file = path(name);
+  if (!fs::exists(file, noThrow())) { return {}; }
+
+  string data;
+  try {
+    data = File::openReadThrow(file).readAll();
+  } catch (const std::exception& e) {
+    log("Can't read tables '%s' : %s\n", file.string().c_str(), e.what());
+    return {};
+  }
+  
+  if (data.size() < 8) { return {}; }
+  u32 crc = 0;
+  memcpy(&crc, data.data() + data.size() - 4, 4);
+  data.resize(data.size() - 4);
+  if (crc != crc32(data.data(), data.size())) {
+    log("Tables '%s' : CRC mismatch, ignored\n", file.string().c_str());
+    fs::remove(file, noThrow());
+    return {};
+  }
+
+  u32 n = 0;
+  memcpy(&n, data.data(), 4);
+  if (n != nParts) { return {}; }
+  
+  vector<string> parts;
+  size_t pos = 4;
+  for (u32 i = 0; i < n; ++i) {
+    u64 size = 0;
+    if (pos + 8 > data.size()) { return {}; }
+    memcpy(&size, data.data() + pos, 8);
+    pos += 8;
+    if (pos + size > data.size()) { return {}; }
+    parts.push_back(data.substr(pos, size));
+    pos += size;
+  }
+  
+  fs::last_write_time(file, fs::file_time_type::clock::now(), noThrow()); // mark as recently used
+  return parts;
+}
+
+void TableCache::save(const string& name, const vector<string>& parts) {
+  string data;
+  u32 n = parts.size();
+  data.append(reinterpret_cast<const char*>(&n), 4);
+  for (const string& part : parts) {
+    u64 size = part.size();
+    data.append(reinterpret_cast<const char*>(&size), 8);
+    data += part;
+  }
+  u32 crc = crc32(data.data(), data.size());
+  data.append(reinterpret_cast<const char*>(&crc), 4);
+
+  fs::path file = path(name);
+  fs::path tmp = file;
+  tmp += ".tmp";
+  try {
+    fs::create_directories(dir);
+    File::openWrite(tmp).write(data);
+    fs::rename(tmp, file);
+  } catch (const std::exception& e) {
+    log("Could not save tables to '%s' : %s\n", file.string().c_str(), e.what());
+    fs::remove(tmp, noThrow());
+    return;
+  }
+  evict();
+}
+
+// Keep only the most recently used maxEntries tables.
+void TableCache::evict() {
+  vector<pair<fs::file_time_type, fs::path>> entries;
+  for (const auto& entry : fs::directory_iterator(dir, noThrow())) {
+    if (entry.is_regular_file() && entry.path().extension() == ".tab") {
+      entries.push_back({fs::last_write_time(entry.path(), noThrow()), entry.path()});
+    }
+  }
+  if (entries.size() <= maxEntries) { return; }
+
+  std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+  for (auto it = entries.begin() + maxEntries; it != entries.end(); ++it) { fs::remove(it->second, noThrow()); }
+}
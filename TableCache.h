@@ -0,0 +1,48 @@
+// Copyright Mihai Preda.
+
+#pragma once
+
+#include "common.h"
+
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <type_traits>
+#include <cassert>
+
+namespace fs = std::filesystem;
+
+// On-disk cache of the tables that the host precomputes for an FFT (weights, trig), which are slow to
+// generate for large FFTs. An entry is a list of binary parts followed by a CRC; a damaged entry is ignored.
+class TableCache {
+  fs::path dir;
+  u32 maxEntries;
+
+  fs::path path(const string& name) const { return dir / (name + ".tab"); }
+  void evict();
+
+public:
+  template<typename T>
+  static string toBytes(const vector<T>& v) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    return {reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T)};
+  }
+
+  template<typename T>
+  static vector<T> fromBytes(const string& s) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    assert(s.size() % sizeof(T) == 0);
+    vector<T> v(s.size() / sizeof(T));
+    memcpy(static_cast<void*>(v.data()), s.data(), s.size());
+    return v;
+  }
+  
+  TableCache(const fs::path& dir, u32 maxEntries) : dir{dir}, maxEntries{maxEntries} {}
+
+  // Returns nullopt if not found or damaged, or if it doesn't have the expected number of parts.
+  std::optional<vector<string>> load(const string& name, u32 nParts);
+
+  void save(const string& name, const vector<string>& parts);
+};
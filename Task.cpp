@@ -74,7 +74,7 @@ void writeResult(u32 E, const char *workType, const string &status, const std::s
 
 }
 
-void Task::writeResultPRP(const Args &args, bool isPrime, u64 res64, u32 fftSize, u32 nErrors, const fs::path& proofPath) const {
+void Task::writeResultPRP(const Args &args, bool isPrime, u64 res64, u32 fftSize, u32 nErrors, const optional<ProofInfo>& proof) const {
   vector<string> fields{json("res64", Hex{res64}),
                         json("residue-type", 1),
                         json("errors", vector<string>{json("gerbicz", nErrors)}),
@@ -82,13 +82,12 @@ void Task::writeResultPRP(const Args &args, bool isPrime, u64 res64, u32 fftSize
   };
 
   // "proof":{"version":1, "power":6, "hashsize":64, "md5":"0123456789ABCDEF"}, 
-  if (!proofPath.empty()) {
-    ProofInfo info = proof::getInfo(proofPath);
+  if (proof) {
     fields.push_back(json("proof", vector<string>{
             json("version", 1),
-            json("power", info.power),
+            json("power", proof->power),
             json("hashsize", 64),
-            json("md5", info.md5)
+            json("md5", proof->md5)
             }));
   }
   
@@ -147,24 +146,50 @@ void Task::adjustBounds(Args& args) {
 }
 
 void Task::execute(const Args& args) {
+  TaskRunner runner;
+  execute(args, runner);
+}
+
+void Task::execute(const Args& args, TaskRunner& runner) {
   LogContext pushContext(std::to_string(exponent));
+  unique_ptr<Gpu>& gpu = runner.gpu;
   
   if (kind == VERIFY) {
     Proof proof = Proof::load(verifyPath);
-    auto gpu = Gpu::make(proof.E, args);
+    gpu = Gpu::reuseOrMake(std::move(gpu), proof.E, args);
     bool ok = proof.verify(gpu.get());
     log("proof '%s' %s\n", verifyPath.c_str(), ok ? "verified" : "failed");
     return;
   }
 
   assert(kind == PRP);
-  auto gpu = Gpu::make(exponent, args);
+  GpuPrefetch prefetched;
+  if (runner.next.valid()) {
+    try {
+      prefetched = runner.next.get();
+    } catch (const char *mes) {
+      log("prefetch failed: %s\n", mes);
+    } catch (const std::exception& e) {
+      log("prefetch failed: %s\n", e.what());
+    }
+  }
+  
+  gpu = Gpu::reuseOrMake(std::move(gpu), exponent, args, &prefetched);
+  if (runner.hasPrevious) { log("idle between tasks: %.2fs\n", runner.sincePrevious.elapsedSecs()); }
   auto fftSize = gpu->getFFTSize();
 
+  if (!line.empty()) {
+    if (optional<Task> next = Worktodo::getNextTask(args, *this); next && next->exponent != exponent) {
+      runner.next = std::async(std::launch::async, Gpu::prefetch, next->exponent, std::cref(args));
+    }
+  }
+
   if (kind == PRP) {
-    auto [factor, isPrime, res64, nErrors, proofPath] = gpu->isPrimePRP(args, *this);
+    auto [factor, isPrime, res64, nErrors, proof] = gpu->isPrimePRP(args, *this);
+    runner.hasPrevious = true;
+    runner.sincePrevious.reset();
     if (factor.empty()) {
-      writeResultPRP(args, isPrime, res64, fftSize, nErrors, proofPath);
+      writeResultPRP(args, isPrime, res64, fftSize, nErrors, proof);
     }
     
     Worktodo::deleteTask(*this);
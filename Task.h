@@ -4,12 +4,15 @@
 #pragma once
 
 #include "Args.h"
+#include "Proof.h"
 #include "common.h"
 #include <string>
+#include <optional>
 #include <cstdio>
 #include <atomic>
 
 class Args;
+struct TaskRunner;
 class Result;
 class Background;
 
@@ -33,7 +36,10 @@ struct Task {
   
   void execute(const Args& args);
 
-  void writeResultPRP(const Args&, bool isPrime, u64 res64, u32 fftSize, u32 nErrors, const fs::path& proofPath) const;
+  // "runner" keeps the Gpu alive from the previous task, and starts the setup of the next task.
+  void execute(const Args& args, TaskRunner& runner);
+
+  void writeResultPRP(const Args&, bool isPrime, u64 res64, u32 fftSize, u32 nErrors, const std::optional<ProofInfo>& proof) const;
   void writeResultPM1(const Args&, const std::string& factor, u32 fftSize) const;
 
   string kindStr() const { return "PRP"; }
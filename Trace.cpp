@@ -0,0 +1,96 @@
+// Copyright Mihai Preda.
+
+#include "Trace.h"
+#include "File.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+// Thread 0 is the GPU; the host threads are numbered from 1 in the order they first add a span.
+constexpr u32 GPU_TID = 0;
+
+struct Entry {
+  std::string name;
+  u64 start, end;
+  u32 tid;
+};
+
+std::atomic<bool> on{false};
+std::mutex mut;
+std::vector<Entry> ring;
+u64 nAdded = 0;
+u32 nThreads = 0;
+std::chrono::steady_clock::time_point epoch;
+
+u32 hostTid() {
+  static thread_local u32 tid = 0;
+  if (!tid) {
+    std::lock_guard lock{mut};
+    tid = ++nThreads;
+  }
+  return tid;
+}
+
+void add(const char* name, const std::string* sname, u64 startNs, u64 endNs, u32 tid) {
+  std::lock_guard lock{mut};
+  // The entries are reused, so once the ring is full the names are assigned without allocating.
+  Entry& e = ring[nAdded++ % ring.size()];
+  if (sname) { e.name = *sname; } else { e.name = name; }
+  e.start = startNs;
+  e.end = endNs;
+  e.tid = tid;
+}
+
+}
+
+void Trace::enable(u32 capacity) {
+  std::lock_guard lock{mut};
+  ring.resize(std::max(capacity, 1u));
+  epoch = std::chrono::steady_clock::now();
+  on = true;
+  log("Tracing the last %u events to trace.json\n", u32(ring.size()));
+}
+
+bool Trace::enabled() { return on.load(std::memory_order_relaxed); }
+
+u64 Trace::nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+void Trace::addHost(const char* name, u64 startNs, u64 endNs) { add(name, nullptr, startNs, endNs, hostTid()); }
+
+void Trace::addKernel(const std::string& name, u64 startNs, u64 endNs) { add(nullptr, &name, startNs, endNs, GPU_TID); }
+
+void Trace::write(const fs::path& file) {
+  if (!enabled()) { return; }
+
+  std::lock_guard lock{mut};
+  try {
+    writeJson(file);
+  } catch (const std::exception& e) {
+    log("Could not write the trace to '%s' : %s\n", file.string().c_str(), e.what());
+  }
+}
+
+void Trace::writeJson(const fs::path& file) {
+  File fo = File::openWrite(file);
+  fo.printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  fo.printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"GPU\"}}", GPU_TID);
+  for (u32 tid = 1; tid <= nThreads; ++tid) {
+    fo.printf(",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"host %u\"}}", tid, tid);
+  }
+
+  u64 n = std::min<u64>(nAdded, ring.size());
+  for (u64 i = nAdded - n; i < nAdded; ++i) {
+    const Entry& e = ring[i % ring.size()];
+    fo.printf(",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+              e.name.c_str(), e.tid == GPU_TID ? "kernel" : "host", e.tid, e.start * 1e-3, (e.end - e.start) * 1e-3);
+  }
+  fo.printf("\n]}\n");
+  log("Wrote %u trace events to '%s'\n", u32(n), file.string().c_str());
+}
@@ -0,0 +1,38 @@
+// Copyright Mihai Preda.
+
+#pragma once
+
+#include "common.h"
+
+#include <filesystem>
+#include <string>
+
+namespace fs = std::filesystem;
+
+// A timeline of the GPU kernels and of the main host steps, written in the Chrome trace format
+// (load it in chrome://tracing or ui.perfetto.dev). Only the most recent events are kept, in a ring buffer.
+class Trace {
+  static void writeJson(const fs::path& file);
+
+public:
+  static void enable(u32 capacity);
+  static bool enabled();
+
+  // Nanoseconds on the host clock, relative to enable().
+  static u64 nowNs();
+
+  static void addHost(const char* name, u64 startNs, u64 endNs);
+  static void addKernel(const std::string& name, u64 startNs, u64 endNs);
+
+  static void write(const fs::path& file);
+};
+
+// Adds a host span covering its lifetime to the trace.
+class TraceSpan {
+  const char* name;
+  u64 start;
+
+public:
+  explicit TraceSpan(const char* name) : name{name}, start{Trace::enabled() ? Trace::nowNs() : 0} {}
+  ~TraceSpan() { if (start) { Trace::addHost(name, start, Trace::nowNs()); } }
+};
@@ -112,6 +112,20 @@ std::optional<Task> Worktodo::getTask(Args &args) {
   return std::nullopt;
 }
 
+std::optional<Task> Worktodo::getNextTask(const Args &args, const Task& current) {
+  bool skippedCurrent = false;
+  for (const string& line : File::openRead("worktodo.txt")) {
+    if (!skippedCurrent && line == current.line) {
+      skippedCurrent = true;
+    } else if (optional<Task> task = parse(line)) {
+      return task;
+    }
+  }
+
+  if (!args.masterDir.empty()) { return firstGoodTask(args.masterDir / "worktodo.txt"); }
+  return std::nullopt;
+}
+
 bool Worktodo::deleteTask(const Task &task) {
   // Some tasks don't originate in worktodo.txt and thus don't need deleting.
   if (task.line.empty()) { return true; }
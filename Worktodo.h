@@ -11,6 +11,10 @@
 class Worktodo {
 public:
   static std::optional<Task> getTask(Args &args);
+
+  // Peeks at the task that getTask() is expected to return after "current" is deleted, without changing
+  // any worktodo file. The bounds of the returned task are not adjusted.
+  static std::optional<Task> getNextTask(const Args &args, const Task& current);
   static bool deleteTask(const Task &task);
   
   static Task makePRP(Args &args, u32 exponent) {
@@ -164,8 +164,15 @@ static string getFreq(cl_device_id device) {
 }
 */
 
+static string getDriverVersion(cl_device_id id) {
+  char version[128] = {0};
+  GET_INFO(id, CL_DRIVER_VERSION, version);
+  return version;
+}
+
 string getShortInfo(cl_device_id device) { return getHwName(device); }
 string getLongInfo(cl_device_id device) { return getShortInfo(device) + "-" + getBoardName(device); }
+string getBuildInfo(cl_device_id device) { return getHwName(device) + " " + getDriverVersion(device); }
 
 cl_device_id getDevice(u32 argsDeviceId) {
   auto devices = getAllDeviceIDs();
@@ -377,6 +384,14 @@ u64 getEventNanos(cl_event event) {
   return end - start;
 }
 
+EventTimes getEventTimes(cl_event event) {
+  EventTimes t{};
+  CHECK1(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(t.queued), &t.queued, 0));
+  CHECK1(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(t.start), &t.start, 0));
+  CHECK1(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(t.end), &t.end, 0));
+  return t;
+}
+
 cl_context getQueueContext(cl_command_queue q) {
   cl_context ret;
   CHECK1(clGetCommandQueueInfo(q, CL_QUEUE_CONTEXT, sizeof(cl_context), &ret, 0));
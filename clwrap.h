@@ -55,6 +55,9 @@ vector<cl_device_id> getAllDeviceIDs();
 string getShortInfo(cl_device_id device);
 string getLongInfo(cl_device_id device);
 
+// Device name and driver version; a compiled binary is only valid for the same build info.
+string getBuildInfo(cl_device_id device);
+
 // Get GPU free memory in bytes.
 u64 getFreeMem(cl_device_id id);
 bool hasFreeMemInfo(cl_device_id id);
@@ -98,6 +101,10 @@ std::string getKernelArgName(cl_kernel k, int pos);
 
 cl_device_id getDevice(u32 argsDevId);
 u64 getEventNanos(cl_event event);
+
+// The device timestamps when the command was queued, started and ended.
+struct EventTimes { u64 queued, start, end; };
+EventTimes getEventTimes(cl_event event);
 u32 getEventInfo(cl_event event);
 
 cl_context getQueueContext(cl_command_queue q);
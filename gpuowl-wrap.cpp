@@ -27,7 +27,6 @@ AMDGPU  : set on AMD GPUs
 HAS_ASM : set if we believe __asm() can be used
 */
 /* List of code-specific macros. These are set by the C++ host code or derived
-EXP        the exponent
 WIDTH
 SMALL_HEIGHT
 MIDDLE
@@ -84,8 +83,8 @@ G_H        "group height"
 #if !UNROLL_WIDTH && !NO_UNROLL_WIDTH && !AMDGPU
 #define UNROLL_WIDTH 1
 #endif
-// Expected defines: EXP the exponent.
-// WIDTH, SMALL_HEIGHT, MIDDLE.
+// Expected defines: WIDTH, SMALL_HEIGHT, MIDDLE.
+// The exponent is not a define; the values that depend on it are set at runtime by writeWeights().
 #define BIG_HEIGHT (SMALL_HEIGHT * MIDDLE)
 #define ND (WIDTH * BIG_HEIGHT)
 #define NWORDS (ND * 2u)
@@ -384,10 +383,12 @@ OVERLOAD TT sq(TT a) { return U2(mad1(RE(a), RE(a), - IM(a) * IM(a)), mul1_m2(RE
 OVERLOAD TT mul(TT a, TT b) { return U2(mad1(RE(a), RE(b), - IM(a) * IM(b)), mad1(RE(a), IM(b), IM(a) * RE(b))); }
 #endif
 bool test(u32 bits, u32 pos) { return (bits >> pos) & 1; }
-#define STEP (NWORDS - (EXP % NWORDS))
+// Set by writeWeights() from the exponent.
+global u32 STEP;       // NWORDS - (EXP % NWORDS)
+global u32 WORD_BITS;  // EXP / NWORDS
 // bool isBigWord(u32 extra) { return extra < NWORDS - STEP; }
 // u32 reduce(u32 extra) { return extra < NWORDS ? extra : (extra - NWORDS); }
-u32 bitlen(bool b) { return EXP / NWORDS + b; }
+u32 bitlen(bool b) { return WORD_BITS + b; }
 // complex add * 2
 TT add_m2(TT a, TT b) { return U2(add1_m2(RE(a), RE(b)), add1_m2(IM(a), IM(b))); }
 // complex mul * 2
@@ -541,11 +542,11 @@ u32 nBits = bitlen(isBigWord);
 Word w = (exactness == MUST_BE_EXACT) ? lowBits(x, nBits) : ulowBits(x, nBits);
 // If nBits could 20 or more we must be careful.  doubleToLong generated x as 13 bits of trash and 51-bit signed value.
 // If we right shift 20 bits we will shift some of the trash into outCarry.  First we must remove the trash bits.
-#if EXP / NWORDS >= 19
+if (WORD_BITS >= 19) {
 *outCarry = as_int2(x << 13).y >> (nBits - 19);
-#else
+} else {
 *outCarry = xtract32(x, nBits);
-#endif
+}
 if (exactness == MUST_BE_EXACT) *outCarry += (w < 0);
 CARRY32_CHECK(*outCarry);
 return w;
@@ -1723,6 +1724,11 @@ global double2 TRIG_W[WIDTH / 2 + 1];
 #endif
 TT THREAD_WEIGHTS[G_W];
 TT CARRY_WEIGHTS[BIG_HEIGHT / CARRY_LEN];
+// Weight steps between the words of a thread, and between the lines of a carry group.
+global double WEIGHT_STEP;
+global double IWEIGHT_STEP;
+global double FWEIGHTS[CARRY_LEN];
+global double IWEIGHTS[CARRY_LEN];
 double2 tableTrig(u32 k, u32 n, u32 kBound, global double2* trigTable) {
 assert(n % 8 == 0);
 assert(k < kBound);       // kBound actually bounds k
@@ -1788,9 +1794,7 @@ return cospi(2 * x);
 #define KERNEL(x) kernel __attribute__((reqd_work_group_size(x, 1, 1))) void
 KERNEL(64) writeGlobals(global float4 * trig2ShSP, global float4 * trigBhSP, global float4 * trigNSP,
 global double2* trig2ShDP, global double2* trigBhDP, global double2* trigNDP,
-global double2* trigW,
-global double2* threadWeights, global double2* carryWeights
-) {
+global double2* trigW) {
 #if SP
 for (u32 k = get_global_id(0); k < 2 * SMALL_HEIGHT/8 + 1; k += get_global_size(0)) { SP_TRIG_2SH[k] = trig2ShSP[k]; }
 for (u32 k = get_global_id(0); k < BIG_HEIGHT/8 + 1; k += get_global_size(0)) { SP_TRIG_BH[k] = trigBhSP[k]; }
@@ -1803,9 +1807,22 @@ for (u32 k = get_global_id(0); k < ND/8 + 1; k += get_global_size(0)) { TRIG_N[k
 #elif TRIG_COMPUTE == 1
 for (u32 k = get_global_id(0); k <= WIDTH/2; k += get_global_size(0)) { TRIG_W[k] = trigW[k]; }
 #endif
-// Weights
+}
+// Everything that depends on the exponent. Run again when the same program is re-targeted to a new exponent.
+KERNEL(64) writeWeights(u32 exponent, global double2* threadWeights, global double2* carryWeights,
+double weightStep, double iweightStep, global double* fweights, global double* iweights) {
+if (get_global_id(0) == 0) {
+STEP = NWORDS - (exponent % NWORDS);
+WORD_BITS = exponent / NWORDS;
+WEIGHT_STEP = weightStep;
+IWEIGHT_STEP = iweightStep;
+}
+for (u32 k = get_global_id(0); k < CARRY_LEN; k += get_global_size(0)) {
+FWEIGHTS[k] = fweights[k];
+IWEIGHTS[k] = iweights[k];
+}
 for (u32 k = get_global_id(0); k < G_W; k += get_global_size(0)) { THREAD_WEIGHTS[k] = threadWeights[k]; }
-for (u32 k = get_global_id(0); k < BIG_HEIGHT / CARRY_LEN; k += get_global_size(0)) { CARRY_WEIGHTS[k] = carryWeights[k]; }  
+for (u32 k = get_global_id(0); k < BIG_HEIGHT / CARRY_LEN; k += get_global_size(0)) { CARRY_WEIGHTS[k] = carryWeights[k]; }
 }
 double2 slowTrig_2SH(u32 k, u32 kBound) { return tableTrig(k, 2 * SMALL_HEIGHT, kBound, TRIG_2SH); }
 double2 slowTrig_BH(u32 k, u32 kBound)  { return tableTrig(k, BIG_HEIGHT, kBound, TRIG_BH); }
@@ -1927,6 +1944,128 @@ return;
 }
 }
 }
+// Packing of the balanced words (in sequential order, see transposeOut) into the E bits of the residue,
+// the same as compactBits() in state.cpp. The words are handled in chunks of COMPACT_CHUNK. The borrow (0 or -1)
+// into a chunk is -1 iff the most significant non-zero word below the chunk is negative.
+#define COMPACT_CHUNK 32
+#define COMPACT_GROUPS 256
+u32 bitposOfWord(u32 E, u32 word) { return (word * (u64) E + (NWORDS - 1)) / NWORDS; }
+// The sign (-1, 0, 1) of the most significant non-zero word of each chunk.
+KERNEL(256) compactSigns(P(i32) signs, CP(Word) in) {
+u32 chunk = get_global_id(0);
+if (chunk >= NWORDS / COMPACT_CHUNK) { return; }
+in += chunk * COMPACT_CHUNK;
+i32 sign = 0;
+for (i32 i = COMPACT_CHUNK - 1; i >= 0; --i) {
+if (in[i]) {
+sign = in[i] < 0 ? -1 : 1;
+break;
+}
+}
+signs[chunk] = sign;
+}
+// A single group; replaces the signs with the borrow into each chunk. The borrow out of the top, which wraps around
+// to bit 0 and is applied by the host, is stored in out[nWords].
+KERNEL(COMPACT_GROUPS) compactCarries(P(u32) out, u32 exponent, P(i32) signs) {
+local i32 lds[COMPACT_GROUPS];
+const u32 nChunks = NWORDS / COMPACT_CHUNK;
+const u32 len = (nChunks - 1) / COMPACT_GROUPS + 1;
+u32 me = get_local_id(0);
+u32 begin = min(me * len, nChunks);
+u32 end = min(begin + len, nChunks);
+i32 top = 0;
+for (u32 c = end; c > begin; --c) {
+if (signs[c - 1]) {
+top = signs[c - 1];
+break;
+}
+}
+lds[me] = top;
+barrier(CLK_LOCAL_MEM_FENCE);
+i32 below = 0;
+for (i32 i = me - 1; i >= 0; --i) {
+if (lds[i]) {
+below = lds[i];
+break;
+}
+}
+for (u32 c = begin; c < end; ++c) {
+i32 sign = signs[c];
+signs[c] = below < 0 ? -1 : 0;
+if (sign) { below = sign; }
+}
+if (me == COMPACT_GROUPS - 1) { out[(exponent - 1) / 32 + 1] = below < 0 ? -1 : 0; }
+}
+// "out" must be zero on entry, except for the borrow word written by compactCarries.
+KERNEL(256) compactWords(P(u32) out, u32 exponent, CP(i32) borrows, CP(Word) in) {
+u32 chunk = get_global_id(0);
+if (chunk >= NWORDS / COMPACT_CHUNK) { return; }
+u32 p = chunk * COMPACT_CHUNK;
+u32 bitpos = bitposOfWord(exponent, p);
+u32 outPos = bitpos / 32;
+u32 have = bitpos % 32;
+bool shared = have != 0; // the first output word is shared with the chunk below
+i32 carry = borrows[chunk];
+u64 acc = 0;
+for (u32 i = 0; i < COMPACT_CHUNK; ++i, ++p) {
+u32 nextBitpos = bitposOfWord(exponent, p + 1);
+u32 nBits = nextBitpos - bitpos;
+bitpos = nextBitpos;
+i32 w = in[p] + carry;
+carry = w < 0 ? -1 : 0;
+if (w < 0) { w += 1 << nBits; }
+acc |= ((u64) (u32) w) << have;
+have += nBits;
+if (have >= 32) {
+if (shared) {
+atomic_or(&out[outPos], (u32) acc);
+shared = false;
+} else {
+out[outPos] = (u32) acc;
+}
+++outPos;
+acc >>= 32;
+have -= 32;
+}
+}
+// The last output word is shared with the chunk above.
+if (have) { atomic_or(&out[outPos], (u32) acc); }
+}
+// The inverse of the packing above, the same as expandBits() in state.cpp. "in" is followed by one zero word.
+// Every word is made balanced by carrying 1 into the next word when it reaches half its base. A word below half
+// minus one absorbs the carry, so the carry into a word is found by looking back just a few words.
+u32 bitsAt(CP(u32) in, u32 bitpos, u32 nBits) {
+u64 v = in[bitpos / 32] | (((u64) in[bitpos / 32 + 1]) << 32);
+return (v >> (bitpos % 32)) & ((1u << nBits) - 1);
+}
+u32 expandCarry(u32 exponent, CP(u32) in, u32 p) {
+while (p > 0) {
+--p;
+u32 bitpos = bitposOfWord(exponent, p);
+u32 nBits = bitposOfWord(exponent, p + 1) - bitpos;
+u32 u = bitsAt(in, bitpos, nBits);
+u32 half = 1u << (nBits - 1);
+if (u != half - 1) { return u >= half; }
+}
+return 0;
+}
+KERNEL(256) expandWords(P(Word) out, u32 exponent, CP(u32) in) {
+u32 chunk = get_global_id(0);
+if (chunk >= NWORDS / COMPACT_CHUNK) { return; }
+u32 p = chunk * COMPACT_CHUNK;
+u32 carry = expandCarry(exponent, in, p);
+u32 bitpos = bitposOfWord(exponent, p);
+for (u32 i = 0; i < COMPACT_CHUNK; ++i, ++p) {
+u32 nextBitpos = bitposOfWord(exponent, p + 1);
+u32 nBits = nextBitpos - bitpos;
+u32 v = bitsAt(in, bitpos, nBits) + carry;
+bitpos = nextBitpos;
+carry = v >= (1u << (nBits - 1));
+out[p] = (i32) v - (carry ? (1 << nBits) : 0);
+}
+// The carry out of the top word wraps around to word 0.
+if (chunk == 0) { out[0] += expandCarry(exponent, in, NWORDS); }
+}
 void fft_WIDTH(local T2 *lds, T2 *u, Trig trig) {
 #if WIDTH == 256
 fft256w(lds, u, trig);
@@ -2062,14 +2201,8 @@ const T TWO_TO_MINUS_NTH[8] = {
 };
 return TWO_TO_MINUS_NTH[i * STEP % NW * (8 / NW)];
 }
-T fweightUnitStep(u32 i) {
-T FWEIGHTS_[] = FWEIGHTS;
-return FWEIGHTS_[i];
-}
-T iweightUnitStep(u32 i) {
-T IWEIGHTS_[] = IWEIGHTS;
-return IWEIGHTS_[i];
-}
+T fweightUnitStep(u32 i) { return FWEIGHTS[i]; }
+T iweightUnitStep(u32 i) { return IWEIGHTS[i]; }
 // fftPremul: weight words with IBDWT weights followed by FFT-width.
 KERNEL(G_W) fftP(P(T2) out, CP(Word2) in, Trig smallTrig) {
 local T2 lds[WIDTH / 2];
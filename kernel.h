@@ -9,6 +9,10 @@
 
 #include <string>
 #include <stdexcept>
+#include <optional>
+#include <vector>
+#include <cstring>
+#include <type_traits>
 
 class Kernel {
   KernelHolder kernel;
@@ -16,14 +20,23 @@ class Kernel {
   QueuePtr queue;
   size_t workSize;
   string name;
+  u32 id;
+
+  // The last value set for each scalar argument, to skip clSetKernelArg() when it doesn't change.
+  // Buffers (cl_mem) are always set: a released buffer's handle may be reused by a new allocation.
+  std::vector<std::optional<u64>> argValues;
 
 public:
+  // Disables the skipping of unchanged scalar arguments, so that -bench can time the submit with and without it.
+  static inline bool alwaysSetArgs = false;
+
   Kernel(cl_program program, QueuePtr queue, cl_device_id device, u32 nWorkGroups, const std::string &name) :
     kernel(makeKernel(program, name.c_str())),
     groupSize(kernel ? getWorkGroupSize(kernel.get(), device, name.c_str()) : 0),
     queue(std::move(queue)),
     workSize(nWorkGroups * groupSize),
-    name(name)
+    name(name),
+    id(this->queue->registerKernel(name))
   {}
 
   Kernel(cl_program program, QueuePtr queue, cl_device_id device, const std::string &name, size_t workSize) :
@@ -31,7 +44,8 @@ public:
     groupSize(kernel ? getWorkGroupSize(kernel.get(), device, name.c_str()) : 0),
     queue(std::move(queue)),
     workSize(workSize),
-    name(name)
+    name(name),
+    id(this->queue->registerKernel(name))
   {
     assert(groupSize == 0 || (workSize % groupSize == 0));
   }
@@ -50,7 +64,16 @@ private:
   template<typename T> void setArgs(int pos, const ConstBuffer<T>& buf) { setArgs(pos, buf.get()); }
   template<typename T> void setArgs(int pos, const Buffer<T>& buf) { setArgs(pos, buf.get()); }
   template<typename T> void setArgs(int pos, const HostAccessBuffer<T>& buf) { setArgs(pos, buf.get()); }
-  template<typename T> void setArgs(int pos, const T &arg) { ::setArg(kernel.get(), pos, arg); }
+  template<typename T> void setArgs(int pos, const T &arg) {
+    if constexpr (sizeof(T) <= sizeof(u64) && !std::is_pointer_v<T>) {
+      u64 bits = 0;
+      memcpy(&bits, &arg, sizeof(T));
+      if (pos >= int(argValues.size())) { argValues.resize(pos + 1); }
+      if (argValues[pos] == bits && !alwaysSetArgs) { return; }
+      argValues[pos] = bits;
+    }
+    ::setArg(kernel.get(), pos, arg);
+  }
   
   template<typename T, typename... Args> void setArgs(int pos, const T &arg, const Args &...tail) {
     setArgs(pos, arg);
@@ -59,7 +82,7 @@ private:
   
   void run() {
     if (kernel) {
-      queue->run(kernel.get(), groupSize, workSize, name);
+      queue->run(kernel.get(), groupSize, workSize, id);
     } else {
       throw std::runtime_error("OpenCL kernel "s + name + " not found");
     }
@@ -6,7 +6,7 @@
 
 vector<File> logFiles;
 string globalCpuName;
-string context;
+thread_local string context;
 
 void initLog() { logFiles.emplace_back(stdout, "stdout"); }
 
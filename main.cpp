@@ -2,11 +2,14 @@
 
 #include "Args.h"
 #include "Task.h"
+#include "Gpu.h"
+#include "Bench.h"
 #include "Worktodo.h"
 #include "common.h"
 #include "File.h"
 #include "version.h"
 #include "AllocTrac.h"
+#include "Trace.h"
 #include "typeName.h"
 #include "log.h"
 
@@ -69,13 +72,19 @@ int main(int argc, char **argv) {
     if (!args.cpu.empty()) { globalCpuName = args.cpu; }
     
     if (args.maxAlloc) { AllocTrac::setMaxAlloc(args.maxAlloc); }
+    if (args.traceSize) { Trace::enable(args.traceSize); }
     
-    if (args.prpExp) {
+    if (args.bench) {
+      bench(args);
+    } else if (args.tuneExp) {
+      tune(args, args.tuneExp);
+    } else if (args.prpExp) {
       Worktodo::makePRP(args, args.prpExp).execute(args);
     } else if (!args.verifyPath.empty()) {
       Worktodo::makeVerify(args, args.verifyPath).execute(args);
     } else {
-      while (auto task = Worktodo::getTask(args)) { task->execute(args); }
+      TaskRunner runner;
+      while (auto task = Worktodo::getTask(args)) { task->execute(args, runner); }
     }
   } catch (const char *mes) {
     log("Exiting because \"%s\"\n", mes);
@@ -85,6 +94,7 @@ int main(int argc, char **argv) {
     log("Unexpected exception\n");
   }
 
+  Trace::write("trace.json");
   // background.wait();
   // if (factorFoundForExp) { Worktodo::deletePRP(factorFoundForExp); }
   log("Bye\n");
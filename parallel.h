@@ -0,0 +1,28 @@
+// Copyright Mihai Preda.
+
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+inline u32 hostThreads() { return std::max(1u, std::thread::hardware_concurrency()); }
+
+// Splits [0, n) into one contiguous chunk per host thread and runs f(begin, end) on each chunk.
+// Small ranges (below minChunk per thread) are not worth the thread start-up, and run inline.
+template<typename F>
+void parallelFor(u32 n, F f, u32 minChunk = 1024) {
+  u32 nThreads = std::min(hostThreads(), std::max(1u, n / minChunk));
+  if (nThreads <= 1) {
+    f(0u, n);
+    return;
+  }
+
+  u32 chunk = (n - 1) / nThreads + 1;
+  vector<std::thread> threads;
+  for (u32 begin = chunk; begin < n; begin += chunk) { threads.emplace_back(f, begin, std::min(n, begin + chunk)); }
+  f(0u, std::min(n, chunk));
+  for (auto& t : threads) { t.join(); }
+}
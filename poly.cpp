@@ -0,0 +1,143 @@
+// Copyright Mihai Preda.
+
+// Runs a P-1 on the host, and checks both stage 2 engines against the reference stage 2:
+// the product of (x^p - 1) over the primes p in (B1, B2], with x the stage 1 residue.
+// - pair: the prime-pairing plan of Pm1Plan, emulated with the same terms as the GPU (x^((b*D)^2) - x^(j^2)).
+// - poly: the polynomial multipoint evaluation of PolyP2.
+// Every factor found by the reference must be found by both. For small exponents only.
+
+#include "PolyP2.h"
+#include "Pm1Plan.h"
+#include "GmpUtil.h"
+#include "Sieve.h"
+#include "log.h"
+#include "timeutil.h"
+
+#include <gmpxx.h>
+#include <cassert>
+#include <unordered_map>
+
+namespace {
+
+struct Mod {
+  const mpz_class M;
+
+  mpz_class mul(const mpz_class& a, const mpz_class& b) const {
+    mpz_class ret = a * b;
+    mpz_mod(ret.get_mpz_t(), ret.get_mpz_t(), M.get_mpz_t());
+    return ret;
+  }
+
+  mpz_class pow(const mpz_class& x, const mpz_class& e) const {
+    mpz_class ret;
+    mpz_powm(ret.get_mpz_t(), x.get_mpz_t(), e.get_mpz_t(), M.get_mpz_t());
+    return ret;
+  }
+
+  mpz_class sub(const mpz_class& a, const mpz_class& b) const { return a >= b ? mpz_class{a - b} : mpz_class{a + M - b}; }
+
+  string gcd(const mpz_class& a) const {
+    mpz_class g = ::gcd(M, a);
+    return g == 1 ? ""s : g.get_str();
+  }
+};
+
+// 3^powerSmooth(E, B1), as the GPU stage 1.
+mpz_class stage1(const Mod& m, u32 E, u32 B1) {
+  mpz_class x{1};
+  for (bool bit : powerSmoothMSB(E, B1)) {
+    x = m.mul(x, x);
+    if (bit) { x = m.mul(x, 3); }
+  }
+  return x;
+}
+
+mpz_class reference(const Mod& m, const mpz_class& x, u32 B1, u32 B2) {
+  vector<u32> primes = sieve::primes(B1 + 1, B2);
+  assert(!primes.empty());
+  unordered_map<u32, mpz_class> gaps; // x^gap
+  mpz_class xp = m.pow(x, primes[0]);
+  mpz_class acc = m.sub(xp, 1);
+  for (u32 i = 1; i < primes.size(); ++i) {
+    u32 gap = primes[i] - primes[i - 1];
+    auto it = gaps.find(gap);
+    if (it == gaps.end()) { it = gaps.emplace(gap, m.pow(x, gap)).first; }
+    xp = m.mul(xp, it->second);
+    acc = m.mul(acc, m.sub(xp, 1));
+  }
+  return acc;
+}
+
+mpz_class pairing(const Mod& m, const mpz_class& x, u32 B1, u32 B2, u32 nBuf) {
+  auto [D, plan] = Pm1Plan::chooseD(nBuf, B1, B2);
+  auto [beginBlock, selected] = plan;
+  const vector<u32> jset = Pm1Plan{D, nBuf, B1, B2}.jset;
+
+  vector<mpz_class> little;
+  for (u32 j : jset) { little.push_back(m.pow(x, mpz_class{j} * j)); }
+
+  // The big values x^((b*D)^2) are stepped as on the GPU.
+  mpz_class big = m.pow(x, mpz_class{beginBlock} * beginBlock * D * D);
+  mpz_class delta = m.pow(x, mpz_class{2 * beginBlock + 1} * D * D);
+  const mpz_class delta2 = m.pow(x, mpz_class{2} * D * D);
+
+  mpz_class acc{1};
+  for (u32 b = beginBlock; b < selected.size(); ++b) {
+    for (u32 i = 0; i < jset.size(); ++i) {
+      if (selected[b][i]) { acc = m.mul(acc, m.sub(big, little[i])); }
+    }
+    big = m.mul(big, delta);
+    delta = m.mul(delta, delta2);
+  }
+  return acc;
+}
+
+// True if every prime factor of "want" divides "got".
+bool covers(const string& got, const string& want) {
+  return want.empty() || (!got.empty() && mpz_class{got} % mpz_class{want} == 0);
+}
+
+}
+
+int main(int argc, char** argv) {
+  initLog();
+
+  if (argc < 4) {
+    printf("Use: poly <exponent> <B1> <B2> [<nBuf>]\nE.g. poly 20113 1000 1000000 300\n");
+    exit(-1);
+  }
+
+  u32 E = atoi(argv[1]);
+  u32 B1 = atoi(argv[2]);
+  u32 B2 = atoi(argv[3]);
+  u32 nBuf = argc > 4 ? atoi(argv[4]) : 300;
+  assert(B1 < B2);
+
+  try {
+    polyP2Secs(E, B1, B2);
+
+    Mod m{(mpz_class{1} << E) - 1};
+    Timer timer;
+    mpz_class x = stage1(m, E, B1);
+    string factor1 = m.gcd(x - 1);
+    log("stage 1 %.1fs: %s\n", timer.deltaSecs(), factor1.empty() ? "no factor" : factor1.c_str());
+
+    string ref = m.gcd(reference(m, x, B1, B2));
+    log("reference %.1fs: %s\n", timer.deltaSecs(), ref.empty() ? "no factor" : ref.c_str());
+
+    string pairFactor = m.gcd(pairing(m, x, B1, B2, nBuf));
+    log("pair      %.1fs: %s\n", timer.deltaSecs(), pairFactor.empty() ? "no factor" : pairFactor.c_str());
+
+    Words p1Data((E - 1) / 32 + 1);
+    mpz_export(p1Data.data(), nullptr, -1 /*order: LSWord first*/, sizeof(u32), 0 /*endianess: native*/, 0 /*nails*/, x.get_mpz_t());
+    string polyFactor = polyP2(E, p1Data, B1, B2);
+    log("poly      %.1fs: %s\n", timer.deltaSecs(), polyFactor.empty() ? "no factor" : polyFactor.c_str());
+
+    bool ok = covers(pairFactor, ref) && covers(polyFactor, ref);
+    log("%s\n", ok ? "OK" : "MISMATCH");
+    return ok ? 0 : 1;
+  } catch (const char* err) {
+    log("%s\n", err);
+    return 2;
+  }
+}